@@ -8,9 +8,89 @@
 //  
 //  DONT FORGET TO REMOVE ASSERTS!
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A ROM-specialised build includes the header generated by main --specialize, which
+// defines CPU_SPECIALIZED_OPCODES: build with -DCPU_OPCODE_HEADER='"opcodes.h"'.
+#if defined(CPU_OPCODE_HEADER)
+    #include CPU_OPCODE_HEADER
+#endif
+
+#if defined(__linux__)
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+// The sound device's AVX2 kernels are compiled for x86 and selected at run time.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #include <immintrin.h>
+    #define CPU_SOUND_AVX2 1
+#endif
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+#if defined(__unix__)
+    #include <poll.h>
+    #include <signal.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
+// USDT (User Statically-Defined Tracing) probe points.
+// When <sys/sdt.h> is available each probe compiles to a single NOP plus an ELF note,
+// so bpftrace/perf can attach to e.g. usdt:./main:cpu6502:execute_entry at runtime.
+// Without the header (or with CPU_DISABLE_PROBES defined) the probes compile to nothing.
+#if !defined(CPU_DISABLE_PROBES) && defined(__has_include)
+    #if __has_include(<sys/sdt.h>)
+        #include <sys/sdt.h>
+        #define CPU_PROBES_ENABLED 1
+    #endif
+#endif
+
+#if defined(CPU_PROBES_ENABLED)
+    #define CPU_PROBE0(Name)                    DTRACE_PROBE(cpu6502, Name)
+    #define CPU_PROBE1(Name, A1)                DTRACE_PROBE1(cpu6502, Name, A1)
+    #define CPU_PROBE2(Name, A1, A2)            DTRACE_PROBE2(cpu6502, Name, A1, A2)
+    #define CPU_PROBE3(Name, A1, A2, A3)        DTRACE_PROBE3(cpu6502, Name, A1, A2, A3)
+#else
+    #define CPU_PROBE0(Name)                    do {} while (0)
+    #define CPU_PROBE1(Name, A1)                do { (void)(A1); } while (0)
+    #define CPU_PROBE2(Name, A1, A2)            do { (void)(A1); (void)(A2); } while (0)
+    #define CPU_PROBE3(Name, A1, A2, A3)        do { (void)(A1); (void)(A2); (void)(A3); } while (0)
+#endif
 
 // This struct represents a memory block.
 struct Mem {
@@ -22,6 +102,18 @@ struct Mem {
     // It is an array of std::uint8_t (unsigned 8-bit integers) with a size of MAX_MEM.
     std::uint8_t Data[MAX_MEM];
 
+    // The default constructor leaves Data uninitialised; CPU::Reset clears it with Initialise.
+    Mem() = default;
+
+    // Constant-initialises the memory with Image placed at Base and every other byte 0.
+    // Usable in constant expressions, so a machine with its ROM in place can live in .data
+    // and needs neither Initialise nor a file load at startup.
+    constexpr Mem(const std::uint8_t* Image, std::uint32_t Size, std::uint32_t Base) : Data{} {
+        for (std::uint32_t i = 0; i < Size && Base + i < MAX_MEM; i++) {
+            Data[Base + i] = Image[i];
+        }
+    }
+
     // This function initializes the elements of the Data array to 0.
     void Initialise() {
         // This for loop iterates over each element of the Data array.
@@ -67,162 +159,4607 @@ struct Mem {
 };
 
 
-// This struct represents a CPU.
-struct CPU {
-    std::uint16_t PC, SP;       // Program Counter & Stack Pointer
-    std::uint8_t A, X, Y;       // Accumulator, Index X & Y registers
-    std::uint8_t C : 1;         // Carry Status flag
-    std::uint8_t Z : 1;         // Zero flag
-    std::uint8_t I : 1;         // Interrupt Disable flag
-    std::uint8_t D : 1;         // Decimal Mode flag
-    std::uint8_t B : 1;         // Break Command flag
-    std::uint8_t V : 1;         // Overflow flag
-    std::uint8_t N : 1;         // Negative flag
+// This struct maps addresses to symbol names and back, for traces, profiles and disassembly.
+// Symbols come from an ld65 debug file (ld65 -g / --dbgfile: "sym" lines of type "lab") or a label
+// map (VICE "al C:8000 .name" lines as written by ld65 -Ln, or plain "8000 name" lines).
+// The index is one flat image: symbols sorted by address with a per-page start table, so an
+// address lookup is a binary search within a single 256-byte page, plus a by-name permutation.
+// The image is cached next to the source as <file>.symidx and memory-mapped on later runs; the
+// cache is rebuilt whenever the source's size or modification time changes. Layout (host order):
+//   Header, u32 PageStart[257], Symbol Entries[Count], u32 ByName[Count], char Names[NamesBytes]
+struct SymbolTable {
+    static constexpr char MAGIC[8] = { '6', '5', '0', '2', 'S', 'Y', 'M', 'S' };
+    static constexpr std::uint32_t VERSION = 1;
+    static constexpr std::uint32_t PAGES = 256;
 
-    // This function resets the CPU state.
-    void Reset(Mem& memory) {
-        // Reset program counter to 0xFFFC.
-        PC = 0xFFFC;
-        // Reset stack pointer to 0x0100.
-        SP = 0x0100;
-        // Reset all flags to 0.
-        C = Z = I = D = B = V = N = 0;
-        // Reset all registers to 0.
-        A = X = Y = 0;
-        // Initialize memory.
-        memory.Initialise();
+    struct Header {
+        char Magic[8];
+        std::uint32_t Version;
+        std::uint32_t Count;
+        std::uint32_t NamesBytes;
+        std::uint32_t Reserved;
+        std::uint64_t SourceSize;
+        std::int64_t SourceTime;
+    };
+
+    // This struct is one symbol. Size 0 means the extent is unknown: the symbol then covers every
+    // address up to the next symbol.
+    struct Symbol {
+        std::uint16_t Address;
+        std::uint16_t Size;
+        std::uint32_t Name;             // Offset into Names
+    };
+
+    const std::uint32_t* PageStart = nullptr;
+    const Symbol* Entries = nullptr;
+    const std::uint32_t* ByName = nullptr;
+    const char* Names = nullptr;
+    std::uint32_t Count = 0;
+
+    // Backing store: either a heap image or a read-only mapping of the cache file.
+    std::vector<std::uint8_t> Storage;
+    void* Mapping = nullptr;
+    std::size_t MappingBytes = 0;
+
+    SymbolTable() = default;
+    SymbolTable(const SymbolTable&) = delete;
+    SymbolTable& operator=(const SymbolTable&) = delete;
+    ~SymbolTable() { Unmap(); }
+
+    // Loads the symbols of Path, from its cache when it is current.
+    // @return false if neither the cache nor the source could be read.
+    bool Load(const std::string& Path) {
+        std::error_code Error;
+        std::uint64_t SourceSize = std::filesystem::file_size(Path, Error);
+        if (Error) {
+            return false;
+        }
+        std::int64_t SourceTime = std::filesystem::last_write_time(Path, Error).time_since_epoch().count();
+        std::string CachePath = Path + ".symidx";
+        if (MapCache(CachePath, SourceSize, SourceTime)) {
+            return true;
+        }
+
+        std::FILE* File = std::fopen(Path.c_str(), "r");
+        if (File == nullptr) {
+            return false;
+        }
+        std::vector<Symbol> Parsed;
+        std::string Text;
+        char Line[1024];
+        while (std::fgets(Line, sizeof(Line), File) != nullptr) {
+            ParseLine(Line, Parsed, Text);
+        }
+        std::fclose(File);
+        Build(Parsed, Text, SourceSize, SourceTime);
+
+        // Cache the image for the next run. Written to a temporary file and renamed, so a
+        // concurrent loader never maps a partial index.
+        std::string Temporary = CachePath + ".tmp" + std::to_string(std::random_device{}());
+        std::FILE* Cache = std::fopen(Temporary.c_str(), "wb");
+        if (Cache != nullptr) {
+            bool Written = std::fwrite(Storage.data(), 1, Storage.size(), Cache) == Storage.size();
+            Written = std::fclose(Cache) == 0 && Written;
+            if (Written) {
+                std::filesystem::rename(Temporary, CachePath, Error);
+            } else {
+                std::filesystem::remove(Temporary, Error);
+            }
+        }
+        return true;
     }
 
-    // Fetches a byte from memory at the current program counter (PC) and updates the necessary variables.
-    // @param Cycles The number of cycles taken by the operation (updated by reference).
-    // @param memory The memory block from which to fetch the byte.
-    // @return The fetched byte value.
-    std::uint8_t FetchByte(std::uint32_t& Cycles, Mem& memory) {
-        // Fetch byte from memory at the current program counter (PC).
-        std::uint8_t Data = memory[PC];
-        // Increment program counter (PC).
-        PC++;
-        // Decrement cycle count.
-        Cycles--;
-        // Return fetched byte.
-        return Data;
+    // Builds the index image from parsed symbols; each Symbol::Name is an offset into Text, which
+    // holds NUL-terminated names.
+    void Build(std::vector<Symbol> Parsed, const std::string& Text, std::uint64_t SourceSize = 0, std::int64_t SourceTime = 0) {
+        Unmap();
+        std::stable_sort(Parsed.begin(), Parsed.end(), [](const Symbol& Left, const Symbol& Right) {
+            return Left.Address < Right.Address;
+        });
+        std::uint32_t Symbols = static_cast<std::uint32_t>(Parsed.size());
+        std::uint32_t NamesBytes = static_cast<std::uint32_t>(Text.size());
+        Storage.assign(sizeof(Header) + (PAGES + 1) * 4 + Symbols * sizeof(Symbol) + Symbols * 4 + NamesBytes, 0);
+
+        Header Head{};
+        std::memcpy(Head.Magic, MAGIC, sizeof(MAGIC));
+        Head.Version = VERSION;
+        Head.Count = Symbols;
+        Head.NamesBytes = NamesBytes;
+        Head.SourceSize = SourceSize;
+        Head.SourceTime = SourceTime;
+        std::memcpy(Storage.data(), &Head, sizeof(Head));
+
+        std::uint8_t* Out = Storage.data() + sizeof(Header);
+        std::uint32_t Index = 0;
+        for (std::uint32_t Page = 0; Page <= PAGES; Page++) {
+            while (Index < Symbols && (Parsed[Index].Address >> 8) < Page) {
+                Index++;
+            }
+            std::memcpy(Out + Page * 4, &Index, 4);
+        }
+        Out += (PAGES + 1) * 4;
+        std::memcpy(Out, Parsed.data(), Symbols * sizeof(Symbol));
+        Out += Symbols * sizeof(Symbol);
+
+        std::vector<std::uint32_t> Order(Symbols);
+        for (std::uint32_t i = 0; i < Symbols; i++) {
+            Order[i] = i;
+        }
+        const char* Strings = Text.c_str();
+        std::stable_sort(Order.begin(), Order.end(), [&](std::uint32_t Left, std::uint32_t Right) {
+            return std::strcmp(Strings + Parsed[Left].Name, Strings + Parsed[Right].Name) < 0;
+        });
+        std::memcpy(Out, Order.data(), Symbols * 4);
+        Out += Symbols * 4;
+        std::memcpy(Out, Text.data(), NamesBytes);
+
+        Attach(Storage.data(), Storage.size());
     }
 
-    std::uint16_t FetchWord(std::uint32_t& Cycles, Mem& memory) {
-        // Fetch word from memory at the current program counter (PC)
-        // 6502 is little endian
-        std::uint16_t Data = memory[PC];
-        // Increment program counter (PC).
-        PC++;
+    // @return the symbol covering Address (the nearest one at or below it, unless its Size ends
+    // before Address), or nullptr.
+    const Symbol* Find(std::uint16_t Address) const {
+        if (Count == 0) {
+            return nullptr;
+        }
+        std::uint32_t Page = Address >> 8;
+        const Symbol* End = std::upper_bound(Entries + PageStart[Page], Entries + PageStart[Page + 1], Address,
+                                             [](std::uint16_t Value, const Symbol& Entry) { return Value < Entry.Address; });
+        if (End == Entries) {
+            return nullptr;
+        }
+        const Symbol* Entry = End - 1;
+        if (Entry->Size != 0 && Address - Entry->Address >= Entry->Size) {
+            return nullptr;
+        }
+        return Entry;
+    }
 
-        Data |= (memory[PC] << 8);
-        // Increment program counter (PC).
-        PC++;
-        // Decrement cycle count.
-        Cycles -= 2;
-        // Return fetched byte.
+    // @return the name of a symbol defined exactly at Address, or nullptr.
+    const char* NameAt(std::uint16_t Address) const {
+        if (Count == 0) {
+            return nullptr;
+        }
+        std::uint32_t Page = Address >> 8;
+        const Symbol* Entry = std::lower_bound(Entries + PageStart[Page], Entries + PageStart[Page + 1], Address,
+                                               [](const Symbol& Entry, std::uint16_t Value) { return Entry.Address < Value; });
+        if (Entry == Entries + PageStart[Page + 1] || Entry->Address != Address) {
+            return nullptr;
+        }
+        return Names + Entry->Name;
+    }
 
-        return Data;
+    // Looks up a symbol by name. @return false if there is none.
+    bool AddressOf(const char* Name, std::uint16_t& Address) const {
+        const std::uint32_t* Entry = std::lower_bound(ByName, ByName + Count, Name, [this](std::uint32_t Index, const char* Value) {
+            return std::strcmp(Names + Entries[Index].Name, Value) < 0;
+        });
+        if (Entry == ByName + Count || std::strcmp(Names + Entries[*Entry].Name, Name) != 0) {
+            return false;
+        }
+        Address = Entries[*Entry].Address;
+        return true;
     }
 
-    // Fetches a byte from memory at the current Address and updates the necessary variables.
-    // @param Cycles The number of cycles taken by the operation (updated by reference).
-    // @param memory The memory block from which to fetch the byte.
-    // @return The fetched byte value.
-    std::uint8_t ReadByte(std::uint32_t& Cycles, std::uint8_t Address, Mem& memory) {
-        // Check if PC is within the valid memory range.
-        if (Address >= Mem::MAX_MEM) {
-            throw std::out_of_range("Invalid memory address");
-        }    
-        // Fetch byte from memory at the current Address
-        std::uint8_t Data = memory[Address];
-        // Decrement cycle count.
-        Cycles--;
-        // Return fetched byte.
-        return Data;
+    // Formats Address as "name", "name+offset" or "$XXXX" when no symbol covers it.
+    std::string Describe(std::uint16_t Address) const {
+        char Text[160];
+        const Symbol* Entry = Find(Address);
+        if (Entry == nullptr) {
+            std::snprintf(Text, sizeof(Text), "$%04X", Address);
+        } else if (Entry->Address == Address) {
+            return Names + Entry->Name;
+        } else {
+            std::snprintf(Text, sizeof(Text), "%.140s+%u", Names + Entry->Name, static_cast<unsigned>(Address - Entry->Address));
+        }
+        return Text;
     }
 
-    // *** OPCODES ***
-    // LDA
-    static constexpr std::uint8_t
-        INS_LDA_IM = 0xA9,  // Immediate  
-        INS_LDA_ZP = 0xA5,  // Zero Page
-        INS_LDA_ZPX = 0xB5, // Zero Page X
-        INS_JSR = 0x20;     // JSR
+    // Adds the symbol defined by one line of a debug file or label map, if it defines one.
+    static void ParseLine(const char* Line, std::vector<Symbol>& Parsed, std::string& Text) {
+        unsigned long Address = 0;
+        unsigned long Size = 0;
+        std::string Name;
+        if (std::strncmp(Line, "sym\t", 4) == 0) {
+            // ld65 debug file: sym<TAB>id=N,name="label",...,size=N,...,val=0x8000,...,type=lab
+            const char* Field = Line + 4;
+            bool IsLabel = false;
+            bool HasValue = false;
+            while (*Field != '\0' && *Field != '\n') {
+                const char* Equals = std::strchr(Field, '=');
+                if (Equals == nullptr) {
+                    break;
+                }
+                std::string Key(Field, Equals);
+                const char* Value = Equals + 1;
+                const char* Next;
+                if (*Value == '"') {
+                    Next = std::strchr(Value + 1, '"');
+                    if (Next == nullptr) {
+                        return;
+                    }
+                    if (Key == "name") {
+                        Name.assign(Value + 1, Next);
+                    }
+                    Next++;
+                } else {
+                    Next = Value + std::strcspn(Value, ",\n");
+                    std::string Text(Value, Next);
+                    if (Key == "val") {
+                        Address = std::strtoul(Text.c_str(), nullptr, 0);
+                        HasValue = true;
+                    } else if (Key == "size") {
+                        Size = std::strtoul(Text.c_str(), nullptr, 0);
+                    } else if (Key == "type") {
+                        IsLabel = Text == "lab";
+                    }
+                }
+                Field = *Next == ',' ? Next + 1 : Next;
+            }
+            if (!IsLabel || !HasValue) {
+                return;
+            }
+        } else {
+            // Label map: "al C:8000 .label" (VICE) or "8000 label".
+            char First[64];
+            char Second[64];
+            char Third[256];
+            int Fields = std::sscanf(Line, "%63s %63s %255s", First, Second, Third);
+            const char* Value;
+            const char* Label;
+            if (Fields == 3 && std::strcmp(First, "al") == 0) {
+                Value = Second[1] == ':' ? Second + 2 : Second;
+                Label = Third[0] == '.' ? Third + 1 : Third;
+            } else if (Fields >= 2 && First[0] != ';' && First[0] != '#') {
+                Value = First[0] == '$' ? First + 1 : First;
+                Label = Second;
+            } else {
+                return;
+            }
+            char* End;
+            Address = std::strtoul(Value, &End, 16);
+            if (*End != '\0') {
+                return;
+            }
+            Name = Label;
+        }
+        if (Name.empty() || Address >= Mem::MAX_MEM) {
+            return;
+        }
+        Symbol Entry;
+        Entry.Address = static_cast<std::uint16_t>(Address);
+        Entry.Size = static_cast<std::uint16_t>(std::min<unsigned long>(Size, 0xFFFF));
+        Entry.Name = static_cast<std::uint32_t>(Text.size());
+        Text += Name;
+        Text += '\0';
+        Parsed.push_back(Entry);
+    }
 
-    void LDASetStatus() {
-        // Set zero flag (Z) if accumulator is 0.
-        Z = (A == 0);
-        // Set negative flag (N) if most significant bit of accumulator is set.
-        N = (A & 0b10000000) > 0;
+    // Points the lookup members into an index image. @return false if Image is not a valid index.
+    bool Attach(const std::uint8_t* Image, std::size_t Bytes) {
+        Header Head;
+        if (Bytes < sizeof(Header)) {
+            return false;
+        }
+        std::memcpy(&Head, Image, sizeof(Head));
+        if (std::memcmp(Head.Magic, MAGIC, sizeof(MAGIC)) != 0 || Head.Version != VERSION ||
+            Bytes != sizeof(Header) + (PAGES + 1) * 4 + std::uint64_t(Head.Count) * (sizeof(Symbol) + 4) + Head.NamesBytes) {
+            return false;
+        }
+        PageStart = reinterpret_cast<const std::uint32_t*>(Image + sizeof(Header));
+        Entries = reinterpret_cast<const Symbol*>(PageStart + PAGES + 1);
+        ByName = reinterpret_cast<const std::uint32_t*>(Entries + Head.Count);
+        Names = reinterpret_cast<const char*>(ByName + Head.Count);
+        Count = Head.Count;
+        return true;
     }
 
-    // This function executes the CPU instructions for the given number of cycles.
-    void Execute(std::uint32_t Cycles, Mem& memory) {
-        while (Cycles > 0) {
-            // Fetch next instruction from memory.
-            std::uint8_t Instruction = FetchByte(Cycles, memory);
-            switch (Instruction) {
-                case INS_LDA_IM: {
-                    // Load value from immediate into the accumulator (A).
-                    std::uint8_t Value = FetchByte(Cycles, memory);
-                    A = Value;
-                    LDASetStatus();
-                } break;
-                case INS_LDA_ZP:    {
-                    // Load value from immediate into the accumulator (A).
-                    std::uint8_t ZeroPageAddress = FetchByte(Cycles, memory);
-                    A = ReadByte(Cycles, ZeroPageAddress, memory);
-                    LDASetStatus();
-                } break;
-                case INS_LDA_ZPX:    {
-                    // Load value from immediate into the accumulator (A).
-                    std::uint8_t ZeroPageAddress = FetchByte(Cycles, memory);
-                    ZeroPageAddress += X;
-                    Cycles--;
-                    A = ReadByte(Cycles, ZeroPageAddress, memory);
-                    LDASetStatus();
-                } break;
-                case INS_JSR:   {
-                    std::uint16_t SubAddr = FetchWord(Cycles, memory);
-                    memory.WriteWord(PC - 1, SP, Cycles);
-                    PC = SubAddr;
-                    Cycles --;
-                    SP ++;
-                } break;
-                default: {
-                    // Handle unknown instruction.
-                    std::cout << "Instruction not handled " << static_cast<int>(Instruction) << std::endl;
-                } break;
+    // Maps the cache at Path if it was built from a source of this size and time.
+    bool MapCache(const std::string& Path, std::uint64_t SourceSize, std::int64_t SourceTime) {
+        Header Head;
+        std::FILE* File = std::fopen(Path.c_str(), "rb");
+        if (File == nullptr) {
+            return false;
+        }
+        bool Current = std::fread(&Head, sizeof(Head), 1, File) == 1 && Head.SourceSize == SourceSize && Head.SourceTime == SourceTime;
+        if (!Current) {
+            std::fclose(File);
+            return false;
+        }
+        std::fseek(File, 0, SEEK_END);
+        std::size_t Bytes = static_cast<std::size_t>(std::ftell(File));
+#if defined(__unix__)
+        void* Image = mmap(nullptr, Bytes, PROT_READ, MAP_PRIVATE, fileno(File), 0);
+        std::fclose(File);
+        if (Image == MAP_FAILED) {
+            return false;
+        }
+        Unmap();
+        Storage.clear();
+        Mapping = Image;
+        MappingBytes = Bytes;
+        if (!Attach(static_cast<const std::uint8_t*>(Image), Bytes)) {
+            Unmap();
+            return false;
+        }
+        return true;
+#else
+        // Without mmap the cache still saves the parse and sort: read the image as is.
+        std::vector<std::uint8_t> Image(Bytes);
+        std::fseek(File, 0, SEEK_SET);
+        bool Read = std::fread(Image.data(), 1, Bytes, File) == Bytes;
+        std::fclose(File);
+        if (!Read) {
+            return false;
+        }
+        Storage = std::move(Image);
+        return Attach(Storage.data(), Storage.size());
+#endif
+    }
+
+    void Unmap() {
+#if defined(__unix__)
+        if (Mapping != nullptr) {
+            munmap(Mapping, MappingBytes);
+        }
+#endif
+        Mapping = nullptr;
+        MappingBytes = 0;
+        Count = 0;
+    }
+};
+
+
+// This struct writes 6502 call-stack events in the Chrome trace-event JSON format.
+// Open the resulting file in chrome://tracing or https://ui.perfetto.dev for a flame chart.
+// Timestamps are emulated cycles (shown as microseconds, i.e. a 1 MHz clock).
+// Events are collected in an in-memory buffer and flushed to disk in large chunks.
+struct TraceWriter {
+    // Flush the buffer to disk once it grows beyond this many bytes.
+    static constexpr std::size_t FLUSH_SIZE = 64 * 1024;
+    // Longer symbol names are truncated in the trace.
+    static constexpr std::size_t MAX_NAME = 96;
+
+    std::FILE* File = nullptr;
+    std::string Buffer;
+    // Number of "B" events without a matching "E" event.
+    std::uint32_t Depth = 0;
+    // Optional symbols used to label subroutines (not owned).
+    const SymbolTable* Symbols = nullptr;
+    // A fragment is a piece of a trace (see RegenerateTrace): it has no header or footer, leaves
+    // frames open at Close and writes "E" events for returns from frames opened before it began.
+    bool Fragment = false;
+    // Fragment only: byte offset and size of each "E" event written with no "B" event in this
+    // fragment, so a stitcher can drop the ones that close no frame of an earlier fragment.
+    std::vector<std::pair<std::uint64_t, std::uint32_t>> Unmatched;
+    // Bytes already flushed to File.
+    std::uint64_t Written = 0;
+
+    ~TraceWriter() { Close(); }
+
+    // Opens the output file and writes the JSON header (unless this is a Fragment).
+    // @return false if the file could not be created.
+    bool Open(const char* Path) {
+        File = std::fopen(Path, "wb");
+        if (File == nullptr) {
+            return false;
+        }
+        Buffer.clear();
+        Written = 0;
+        if (!Fragment) {
+            Buffer = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+            Buffer += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"6502\"}}";
+        }
+        return true;
+    }
+
+    // Writes the first MAX_NAME characters of Name to Out (at least MAX_NAME * 6 + 1 bytes) as the
+    // body of a JSON string: '"', '\\' and control characters are escaped, since symbol names
+    // come from user files.
+    static void EscapeName(const char* Name, char* Out) {
+        for (std::size_t i = 0; i < MAX_NAME && Name[i] != '\0'; i++) {
+            unsigned char Char = static_cast<unsigned char>(Name[i]);
+            if (Char == '"' || Char == '\\') {
+                *Out++ = '\\';
+                *Out++ = static_cast<char>(Char);
+            } else if (Char < 0x20) {
+                Out += std::sprintf(Out, "\\u%04x", Char);
+            } else {
+                *Out++ = static_cast<char>(Char);
+            }
+        }
+        *Out = '\0';
+    }
+
+    // Records entry into the subroutine (or handler) at Address.
+    void Begin(std::uint64_t Cycle, std::uint16_t Address) {
+        if (File == nullptr) {
+            return;
+        }
+        char Line[MAX_NAME * 6 + 96];
+        const char* Name = Symbols != nullptr ? Symbols->NameAt(Address) : nullptr;
+        if (Name != nullptr) {
+            char Escaped[MAX_NAME * 6 + 1];
+            EscapeName(Name, Escaped);
+            std::snprintf(Line, sizeof(Line), ",\n{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%llu,\"pid\":1,\"tid\":1}",
+                          Escaped, static_cast<unsigned long long>(Cycle));
+        } else {
+            std::snprintf(Line, sizeof(Line), ",\n{\"name\":\"sub_%04X\",\"ph\":\"B\",\"ts\":%llu,\"pid\":1,\"tid\":1}",
+                          Address, static_cast<unsigned long long>(Cycle));
+        }
+        Append(Line);
+        Depth++;
+    }
+
+    // Records return from the innermost open subroutine.
+    void End(std::uint64_t Cycle) {
+        // An RTS without a matching JSR (e.g. a stack trick) has nothing to close, except in a
+        // fragment, where it may close a frame of an earlier fragment.
+        if (File == nullptr || (Depth == 0 && !Fragment)) {
+            return;
+        }
+        char Line[96];
+        int Size = std::snprintf(Line, sizeof(Line), ",\n{\"ph\":\"E\",\"ts\":%llu,\"pid\":1,\"tid\":1}",
+                                 static_cast<unsigned long long>(Cycle));
+        if (Depth == 0) {
+            Unmatched.emplace_back(Written + Buffer.size(), static_cast<std::uint32_t>(Size));
+        } else {
+            Depth--;
+        }
+        Append(Line, static_cast<std::size_t>(Size));
+    }
+
+    // Closes every open frame at Cycle, writes the JSON footer and closes the file.
+    void Close(std::uint64_t Cycle = 0) {
+        if (File == nullptr) {
+            return;
+        }
+        if (!Fragment) {
+            while (Depth > 0) {
+                End(Cycle);
             }
+            Buffer += "\n]}\n";
+        }
+        Flush();
+        std::fclose(File);
+        File = nullptr;
+    }
+
+    void Append(const char* Text) {
+        Append(Text, std::strlen(Text));
+    }
+
+    void Append(const char* Text, std::size_t Size) {
+        Buffer.append(Text, Size);
+        if (Buffer.size() >= FLUSH_SIZE) {
+            Flush();
         }
     }
+
+    void Flush() {
+        std::fwrite(Buffer.data(), 1, Buffer.size(), File);
+        Written += Buffer.size();
+        Buffer.clear();
+    }
 };
 
 
+// This struct counts reads, writes and executes for every address in Mem::Data.
+// Counters are 32-bit and saturate instead of wrapping. Setting SamplePeriod to N > 1
+// records only every Nth access, which keeps the overhead low on long runs.
+struct MemHeatmap {
+    static constexpr std::uint32_t SATURATED = 0xFFFFFFFF;
 
-// This is the main function of the program.
-int main(int argc, const char * argv[]) {
-    // Create an instance of the Mem class to represent memory.
-    Mem mem;
-    // Create an instance of the CPU class to represent the CPU.
-    CPU cpu;
-    // Reset the CPU state by initialising the member variables and calling the `Initialise` function of the `Mem` object.
-    cpu.Reset(mem);
+    // Counters live in their own arrays so Mem stays a plain 64 KiB block.
+    std::vector<std::uint32_t> Reads, Writes, Executes;
+    std::uint32_t SamplePeriod = 1;
+    std::uint32_t SampleCountdown = 1;
+
+    MemHeatmap() : Reads(Mem::MAX_MEM), Writes(Mem::MAX_MEM), Executes(Mem::MAX_MEM) {}
 
-    // START - Inline a little program
-    // Load the "Load Accumulator Immediate" opcode into memory at address 0xFFFC.
-    mem[0xFFFC] = CPU::INS_JSR;
-    // Load the value 0x42 into memory at address 0xFFFD.
-    mem[0xFFFD] = 0x42;
-    mem[0xFFFE] = 0x42;
-    mem[0x4242] = CPU::INS_LDA_IM;
-    mem[0x4243] = 0x84;
+    void Clear() {
+        std::fill(Reads.begin(), Reads.end(), 0);
+        std::fill(Writes.begin(), Writes.end(), 0);
+        std::fill(Executes.begin(), Executes.end(), 0);
+    }
 
-    // END - Inline a little program
+    void CountRead(std::uint32_t Address) { Count(Reads, Address); }
+    void CountWrite(std::uint32_t Address) { Count(Writes, Address); }
+    void CountExecute(std::uint32_t Address) { Count(Executes, Address); }
 
-    // Execute the CPU instructions for 2 cycles using the provided memory.
-    cpu.Execute(9, mem);
+    // Adds the counts of Other (saturating).
+    void Merge(const MemHeatmap& Other) {
+        for (std::uint32_t i = 0; i < Mem::MAX_MEM; i++) {
+            Reads[i] = static_cast<std::uint32_t>(std::min<std::uint64_t>(SATURATED, std::uint64_t(Reads[i]) + Other.Reads[i]));
+            Writes[i] = static_cast<std::uint32_t>(std::min<std::uint64_t>(SATURATED, std::uint64_t(Writes[i]) + Other.Writes[i]));
+            Executes[i] = static_cast<std::uint32_t>(std::min<std::uint64_t>(SATURATED, std::uint64_t(Executes[i]) + Other.Executes[i]));
+        }
+    }
+
+    void Count(std::vector<std::uint32_t>& Counters, std::uint32_t Address) {
+        // Skip all but every SamplePeriod-th access.
+        if (--SampleCountdown != 0) {
+            return;
+        }
+        SampleCountdown = SamplePeriod;
+        std::uint32_t& Counter = Counters[Address % Mem::MAX_MEM];
+        if (Counter != SATURATED) {
+            Counter++;
+        }
+    }
+
+    // Writes one "address,reads,writes,executes" row per address that was touched.
+    bool WriteCSV(const char* Path) const {
+        std::FILE* File = std::fopen(Path, "w");
+        if (File == nullptr) {
+            return false;
+        }
+        std::fprintf(File, "address,reads,writes,executes\n");
+        for (std::uint32_t i = 0; i < Mem::MAX_MEM; i++) {
+            if (Reads[i] | Writes[i] | Executes[i]) {
+                std::fprintf(File, "0x%04X,%u,%u,%u\n", i, Reads[i], Writes[i], Executes[i]);
+            }
+        }
+        std::fclose(File);
+        return true;
+    }
+
+    // Writes a 256x256 PPM image, one pixel per address (row = page).
+    // Red = writes, green = reads, blue = executes, each on a log scale.
+    bool WritePPM(const char* Path) const {
+        std::FILE* File = std::fopen(Path, "wb");
+        if (File == nullptr) {
+            return false;
+        }
+        std::fprintf(File, "P6\n256 256\n255\n");
+        for (std::uint32_t i = 0; i < Mem::MAX_MEM; i++) {
+            std::uint8_t Pixel[3] = { Scale(Writes[i]), Scale(Reads[i]), Scale(Executes[i]) };
+            std::fwrite(Pixel, 1, sizeof(Pixel), File);
+        }
+        std::fclose(File);
+        return true;
+    }
+
+    // Maps a counter onto 0..255 so that 1 access is visible and 2^32 is full brightness.
+    static std::uint8_t Scale(std::uint32_t Counter) {
+        if (Counter == 0) {
+            return 0;
+        }
+        return static_cast<std::uint8_t>(32 + std::log2(static_cast<double>(Counter)) * (223.0 / 32.0));
+    }
+};
+
+
+// Lock-free single-producer/single-consumer ring of Capacity (a power of two) elements.
+template <typename T, std::size_t Capacity>
+struct SpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    // Head and Tail live on separate cache lines so producer and consumer do not contend.
+    alignas(64) std::atomic<std::size_t> Head { 0 };    // Next slot to read (consumer)
+    alignas(64) std::atomic<std::size_t> Tail { 0 };    // Next slot to write (producer)
+    T Slots[Capacity];
+
+    // Producer side. @return false if the queue is full.
+    bool Push(const T& Value) {
+        std::size_t Position = Tail.load(std::memory_order_relaxed);
+        if (Position - Head.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        Slots[Position & (Capacity - 1)] = Value;
+        Tail.store(Position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side: the oldest element, or nullptr if empty.
+    const T* Peek() const {
+        std::size_t Position = Head.load(std::memory_order_relaxed);
+        if (Position == Tail.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &Slots[Position & (Capacity - 1)];
+    }
+
+    // Consumer side: removes the element returned by Peek.
+    void Pop() {
+        Head.store(Head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+// Lock-free bounded multi-producer/single-consumer queue of Capacity (a power of two) elements.
+// Each cell carries a sequence number telling producers and the consumer whose turn it is.
+template <typename T, std::size_t Capacity>
+struct MpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    struct Cell {
+        std::atomic<std::size_t> Sequence;
+        T Value;
+    };
+
+    Cell Cells[Capacity];
+    alignas(64) std::atomic<std::size_t> EnqueuePosition { 0 };
+    alignas(64) std::size_t DequeuePosition = 0;
+
+    MpscQueue() {
+        for (std::size_t i = 0; i < Capacity; i++) {
+            Cells[i].Sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Producer side, callable from any thread. @return false if the queue is full.
+    bool Push(const T& Value) {
+        std::size_t Position = EnqueuePosition.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& Target = Cells[Position & (Capacity - 1)];
+            std::size_t Sequence = Target.Sequence.load(std::memory_order_acquire);
+            std::intptr_t Difference = static_cast<std::intptr_t>(Sequence) - static_cast<std::intptr_t>(Position);
+            if (Difference == 0) {
+                if (EnqueuePosition.compare_exchange_weak(Position, Position + 1, std::memory_order_relaxed)) {
+                    Target.Value = Value;
+                    Target.Sequence.store(Position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (Difference < 0) {
+                return false;
+            } else {
+                Position = EnqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer side: the oldest element, or nullptr if empty.
+    const T* Peek() const {
+        const Cell& Source = Cells[DequeuePosition & (Capacity - 1)];
+        if (Source.Sequence.load(std::memory_order_acquire) != DequeuePosition + 1) {
+            return nullptr;
+        }
+        return &Source.Value;
+    }
+
+    // Consumer side: removes the element returned by Peek.
+    void Pop() {
+        Cells[DequeuePosition & (Capacity - 1)].Sequence.store(DequeuePosition + Capacity, std::memory_order_release);
+        DequeuePosition++;
+    }
+};
+
+// This struct is one piece of external input for a running machine.
+struct InputEvent {
+    enum : std::uint8_t {
+        WRITE_BYTE,             // Store Value at Address (e.g. a keyboard or serial latch)
+        ASSERT_IRQ,
+        ASSERT_NMI,
+    };
+    // Earliest CPU cycle at which the event is delivered (0 = as soon as possible).
+    std::uint64_t Cycle;
+    std::uint16_t Address;
+    std::uint8_t Value;
+    std::uint8_t Kind;
+};
+
+// This struct carries input from other threads into a running machine without locks.
+// A dedicated producer (e.g. a network bridge) uses Direct; any number of others use Shared.
+// Threaded devices each have a return queue of their own (see DeviceLink), so their events are
+// merged by stamp rather than by the order their threads happened to push them.
+// CPU::Execute drains due events at instruction boundaries.
+// A recorded log (see Record) can be fed back through the Replay range, which is read in place.
+struct InputPort {
+    static constexpr std::size_t CAPACITY = 1024;
+    // Device return queue i is source FROM_DEVICE + i.
+    enum : std::size_t { FROM_DIRECT, FROM_SHARED, FROM_REPLAY, FROM_DEVICE };
+
+    using Queue = SpscQueue<InputEvent, CAPACITY>;
+
+    Queue Direct;
+    MpscQueue<InputEvent, CAPACITY> Shared;
+    // Return queues of threaded devices, each filled in non-decreasing Cycle order (not owned).
+    std::vector<Queue*> Devices;
+    // Recorded events still to replay, sorted by Cycle (both nullptr when not replaying).
+    const InputEvent* ReplayNext = nullptr;
+    const InputEvent* ReplayEnd = nullptr;
+    // When set, every delivered event is appended with Cycle set to the cycle it was delivered at,
+    // so a replay delivers it at exactly the same instruction boundary. Consumer side only.
+    std::vector<InputEvent>* Record = nullptr;
+    // Source the last NextDue result came from.
+    std::size_t From = FROM_DIRECT;
+
+    // Returns the due event with the smallest Cycle (at or before Now) across all sources, or
+    // nullptr. Ties go to the earlier source, so the choice never depends on thread timing.
+    // Consumer side only.
+    const InputEvent* NextDue(std::uint64_t Now) {
+        const InputEvent* Next = nullptr;
+        auto Consider = [&](const InputEvent* Head, std::size_t Source) {
+            if (Head != nullptr && Head->Cycle <= Now && (Next == nullptr || Head->Cycle < Next->Cycle)) {
+                Next = Head;
+                From = Source;
+            }
+        };
+        Consider(Direct.Peek(), FROM_DIRECT);
+        Consider(Shared.Peek(), FROM_SHARED);
+        Consider(ReplayNext != ReplayEnd ? ReplayNext : nullptr, FROM_REPLAY);
+        for (std::size_t i = 0; i < Devices.size(); i++) {
+            Consider(Devices[i]->Peek(), FROM_DEVICE + i);
+        }
+        return Next;
+    }
+
+    // Removes the event returned by NextDue.
+    void PopDue() {
+        if (From == FROM_DIRECT) {
+            Direct.Pop();
+        } else if (From == FROM_SHARED) {
+            Shared.Pop();
+        } else if (From == FROM_REPLAY) {
+            ReplayNext++;
+        } else {
+            Devices[From - FROM_DEVICE]->Pop();
+        }
+    }
+};
+
+
+// This struct emulates a SID-style sound chip: three oscillators (triangle, saw, pulse, noise)
+// with ADSR envelopes, a state-variable filter and a master volume. Registers are mirrored every
+// 32 bytes over $D400-$D7FF with the SID layout: per voice (7 bytes from $D400, $D407, $D40E)
+// frequency lo/hi, pulse width lo/hi, control, attack/decay, sustain/release; then $D415/$D416
+// cutoff, $D417 resonance/routing, $D418 filter mode/volume.
+// Audio is not emulated per cycle. Register writes and the end of CPU::Execute call Sync, which
+// renders every sample due before that cycle in blocks of BLOCK samples with the registers as
+// they were, so the cost is per sample, not per emulated cycle. The oscillator and mixing kernel
+// has an AVX2 version chosen at run time; the filter is recursive per sample and stays scalar.
+// Hard sync and ring modulation are not modelled. Samples go to a WAV file and/or a ring buffer.
+struct SoundDevice {
+    static constexpr std::uint16_t BASE = 0xD400;
+    static constexpr std::uint32_t REGISTERS = 32;
+    static constexpr std::uint32_t VOICES = 3;
+    static constexpr std::uint32_t BLOCK = 256;
+    // Emulated clock (a 1 MHz clock, as for trace timestamps).
+    static constexpr std::uint64_t CLOCK = 1000000;
+    // Register offsets within one voice and of the filter block.
+    static constexpr std::uint32_t
+        VOICE_CONTROL = 4,
+        VOICE_ATTACK_DECAY = 5,
+        VOICE_SUSTAIN_RELEASE = 6,
+        FILTER_ROUTING = 0x17,
+        MODE_VOLUME = 0x18;
+    // Voice control bits.
+    static constexpr std::uint8_t
+        CONTROL_GATE = 0x01,
+        CONTROL_TEST = 0x08,
+        CONTROL_TRIANGLE = 0x10,
+        CONTROL_SAW = 0x20,
+        CONTROL_PULSE = 0x40,
+        CONTROL_NOISE = 0x80;
+
+    using SampleRing = SpscQueue<std::int16_t, 1 << 14>;
+
+    enum class Stage : std::uint8_t { Attack, Decay, Sustain, Release };
+
+    // This struct is the running state of one oscillator and its envelope.
+    struct Voice {
+        float Phase = 0.0f;             // Oscillator phase in [0, 1)
+        float Envelope = 0.0f;          // Envelope level in [0, 1]
+        Stage EnvelopeStage = Stage::Release;
+        std::uint32_t Noise = 0x7FFFF8; // 23-bit noise LFSR
+        std::uint32_t NoiseStep = 0;    // Phase sixteenth at the last LFSR clock
+    };
+
+    std::uint32_t SampleRate = 44100;
+    std::uint8_t Registers[REGISTERS] = {};
+    Voice Voices[VOICES];
+    float Low = 0.0f;                   // Filter state
+    float Band = 0.0f;
+    std::uint64_t SamplesDone = 0;
+
+    // Outputs (either may be unset).
+    std::FILE* Wav = nullptr;
+    std::uint32_t WavSamples = 0;
+    SampleRing* Ring = nullptr;
+    // Samples lost because the ring buffer was full.
+    std::uint64_t Dropped = 0;
+
+    ~SoundDevice() { CloseWav(); }
+
+    // @return true if a write to Address lands in the device's registers.
+    static bool Maps(std::uint16_t Address) {
+        return (Address & 0xFC00) == BASE;
+    }
+
+    // Writes a register at Cycle, after rendering everything before it.
+    void Write(std::uint64_t Cycle, std::uint16_t Address, std::uint8_t Value) {
+        Sync(Cycle);
+        std::uint32_t Register = Address & (REGISTERS - 1);
+        std::uint8_t Previous = Registers[Register];
+        Registers[Register] = Value;
+        if (Register < VOICES * 7 && Register % 7 == VOICE_CONTROL) {
+            Voice& Target = Voices[Register / 7];
+            if ((Value & CONTROL_GATE) != 0 && (Previous & CONTROL_GATE) == 0) {
+                Target.EnvelopeStage = Stage::Attack;
+            } else if ((Value & CONTROL_GATE) == 0 && (Previous & CONTROL_GATE) != 0) {
+                Target.EnvelopeStage = Stage::Release;
+            }
+        }
+    }
+
+    // Renders every sample that starts before Cycle.
+    void Sync(std::uint64_t Cycle) {
+        std::uint64_t Due = Cycle * SampleRate / CLOCK;
+        while (SamplesDone < Due) {
+            std::uint32_t Count = static_cast<std::uint32_t>(std::min<std::uint64_t>(BLOCK, Due - SamplesDone));
+            RenderBlock(Count);
+            SamplesDone += Count;
+        }
+    }
+
+    // Starts a 16-bit mono WAV file. @return false if it could not be created.
+    bool OpenWav(const char* Path) {
+        CloseWav();
+        Wav = std::fopen(Path, "wb");
+        if (Wav == nullptr) {
+            return false;
+        }
+        WavSamples = 0;
+        WriteWavHeader();
+        return true;
+    }
+
+    // Completes the WAV header and closes the file.
+    void CloseWav() {
+        if (Wav == nullptr) {
+            return;
+        }
+        std::fseek(Wav, 0, SEEK_SET);
+        WriteWavHeader();
+        std::fclose(Wav);
+        Wav = nullptr;
+    }
+
+    void WriteWavHeader() {
+        std::uint32_t DataBytes = WavSamples * 2;
+        std::uint8_t Header[44];
+        auto Put16 = [&](std::uint32_t Offset, std::uint32_t Value) {
+            Header[Offset] = static_cast<std::uint8_t>(Value);
+            Header[Offset + 1] = static_cast<std::uint8_t>(Value >> 8);
+        };
+        auto Put32 = [&](std::uint32_t Offset, std::uint32_t Value) {
+            Put16(Offset, Value & 0xFFFF);
+            Put16(Offset + 2, Value >> 16);
+        };
+        std::memcpy(Header, "RIFF", 4);
+        Put32(4, 36 + DataBytes);
+        std::memcpy(Header + 8, "WAVEfmt ", 8);
+        Put32(16, 16);                  // fmt chunk size
+        Put16(20, 1);                   // PCM
+        Put16(22, 1);                   // mono
+        Put32(24, SampleRate);
+        Put32(28, SampleRate * 2);      // byte rate
+        Put16(32, 2);                   // block align
+        Put16(34, 16);                  // bits per sample
+        std::memcpy(Header + 36, "data", 4);
+        Put32(40, DataBytes);
+        std::fwrite(Header, 1, sizeof(Header), Wav);
+    }
+
+    // Renders Count (at most BLOCK) samples with the current registers.
+    void RenderBlock(std::uint32_t Count) {
+        alignas(32) float Direct[BLOCK] = {};
+        alignas(32) float Filtered[BLOCK] = {};
+        alignas(32) float Envelope[BLOCK];
+        std::uint8_t Routing = Registers[FILTER_ROUTING];
+        std::uint8_t ModeVolume = Registers[MODE_VOLUME];
+
+        for (std::uint32_t Index = 0; Index < VOICES; Index++) {
+            const std::uint8_t* Voice = Registers + Index * 7;
+            SoundDevice::Voice& State = Voices[Index];
+            bool IsFiltered = (Routing >> Index) & 1;
+            // Voice 3 can be taken out of the direct mix (it is then only a modulation source).
+            if (Index == 2 && !IsFiltered && (ModeVolume & 0x80) != 0) {
+                FillEnvelope(State, Voice, Envelope, Count);
+                State.Phase = Advance(State.Phase, Increment(Voice), Count);
+                continue;
+            }
+            FillEnvelope(State, Voice, Envelope, Count);
+            float* Out = IsFiltered ? Filtered : Direct;
+            std::uint8_t Control = Voice[VOICE_CONTROL];
+            float PulseWidth = ((Voice[3] & 0x0F) << 8 | Voice[2]) / 4096.0f;
+            if ((Control & CONTROL_TEST) != 0) {
+                // The test bit holds the oscillator at zero.
+                State.Phase = 0.0f;
+            } else if ((Control & CONTROL_NOISE) != 0) {
+                Noise(State, Out, Envelope, Count, Increment(Voice), PulseWidth, Control);
+            } else if (UseAVX2()) {
+                State.Phase = OscillateAVX2(Out, Envelope, Count, State.Phase, Increment(Voice), PulseWidth, Control);
+            } else {
+                State.Phase = OscillateScalar(Out, Envelope, Count, State.Phase, Increment(Voice), PulseWidth, Control);
+            }
+        }
+
+        // State-variable filter: 11-bit cutoff mapped to 30 Hz..12 kHz, 4-bit resonance.
+        std::uint32_t Cutoff = (Registers[0x16] << 3) | (Registers[0x15] & 0x07);
+        float Frequency = 30.0f + Cutoff * (12000.0f - 30.0f) / 2047.0f;
+        float Coefficient = std::min(1.0f, 2.0f * std::sin(3.14159265f * Frequency / SampleRate));
+        float Damping = 1.4f - 1.2f * (Routing >> 4) / 15.0f;
+        float Volume = (ModeVolume & 0x0F) / 15.0f / VOICES;
+        std::int16_t Samples[BLOCK];
+        for (std::uint32_t i = 0; i < Count; i++) {
+            Low += Coefficient * Band;
+            float High = Filtered[i] - Low - Damping * Band;
+            Band += Coefficient * High;
+            float Out = Direct[i];
+            if ((ModeVolume & 0x10) != 0) Out += Low;
+            if ((ModeVolume & 0x20) != 0) Out += Band;
+            if ((ModeVolume & 0x40) != 0) Out += High;
+            Out = std::max(-1.0f, std::min(1.0f, Out * Volume));
+            Samples[i] = static_cast<std::int16_t>(Out * 32767.0f);
+        }
+
+        if (Wav != nullptr) {
+            std::fwrite(Samples, 2, Count, Wav);
+            WavSamples += Count;
+        }
+        if (Ring != nullptr) {
+            for (std::uint32_t i = 0; i < Count; i++) {
+                if (!Ring->Push(Samples[i])) {
+                    Dropped++;
+                }
+            }
+        }
+    }
+
+    // @return the oscillator phase step per output sample.
+    float Increment(const std::uint8_t* Voice) const {
+        std::uint32_t Frequency = Voice[1] << 8 | Voice[0];
+        // The 24-bit accumulator adds Frequency every cycle.
+        return static_cast<float>(Frequency * static_cast<double>(CLOCK) / SampleRate / 16777216.0);
+    }
+
+    static float Advance(float Phase, float Increment, std::uint32_t Count) {
+        float Next = Phase + Increment * Count;
+        return Next - std::floor(Next);
+    }
+
+    // Steps the voice's ADSR envelope over Count samples into Envelope.
+    void FillEnvelope(Voice& State, const std::uint8_t* Voice, float* Envelope, std::uint32_t Count) const {
+        // Attack times in milliseconds; decay and release take three times as long.
+        static constexpr float RATE_MS[16] = { 2, 8, 16, 24, 38, 56, 68, 80, 100, 250, 500, 800, 1000, 3000, 5000, 8000 };
+        float Attack = 1000.0f / (RATE_MS[Voice[VOICE_ATTACK_DECAY] >> 4] * SampleRate);
+        float Decay = 1000.0f / (3.0f * RATE_MS[Voice[VOICE_ATTACK_DECAY] & 0x0F] * SampleRate);
+        float Sustain = (Voice[VOICE_SUSTAIN_RELEASE] >> 4) / 15.0f;
+        float Release = 1000.0f / (3.0f * RATE_MS[Voice[VOICE_SUSTAIN_RELEASE] & 0x0F] * SampleRate);
+        float Level = State.Envelope;
+        for (std::uint32_t i = 0; i < Count; i++) {
+            switch (State.EnvelopeStage) {
+                case Stage::Attack:
+                    Level += Attack;
+                    if (Level >= 1.0f) {
+                        Level = 1.0f;
+                        State.EnvelopeStage = Stage::Decay;
+                    }
+                    break;
+                case Stage::Decay:
+                    Level -= Decay;
+                    if (Level <= Sustain) {
+                        Level = Sustain;
+                        State.EnvelopeStage = Stage::Sustain;
+                    }
+                    break;
+                case Stage::Sustain:
+                    Level = std::min(Level, Sustain);
+                    break;
+                case Stage::Release:
+                    Level = std::max(0.0f, Level - Release);
+                    break;
+            }
+            Envelope[i] = Level;
+        }
+        State.Envelope = Level;
+    }
+
+    // Adds Count samples of a noise voice (combined with any other selected waveforms) to Out.
+    // The LFSR is clocked sixteen times per oscillator period, as the SID clocks it from bit 19.
+    static void Noise(Voice& State, float* Out, const float* Envelope, std::uint32_t Count, float Increment, float PulseWidth, std::uint8_t Control) {
+        float Phase = State.Phase;
+        for (std::uint32_t i = 0; i < Count; i++) {
+            Phase += Increment;
+            if (Phase >= 1.0f) {
+                Phase -= std::floor(Phase);
+            }
+            std::uint32_t Step = static_cast<std::uint32_t>(Phase * 16.0f);
+            if (Step != State.NoiseStep) {
+                State.NoiseStep = Step;
+                std::uint32_t Bit = ((State.Noise >> 22) ^ (State.Noise >> 17)) & 1;
+                State.Noise = ((State.Noise << 1) | Bit) & 0x7FFFFF;
+            }
+            float Wave = std::min(((State.Noise >> 15) & 0xFF) / 127.5f - 1.0f, Waveform(Phase, PulseWidth, Control & ~CONTROL_NOISE));
+            Out[i] += Wave * Envelope[i];
+        }
+        State.Phase = Phase;
+    }
+
+    // @return the combination of the selected triangle, saw and pulse waveforms at Phase. The SID
+    // ANDs combined waveforms; the minimum is a cheap approximation. 1 (neutral) if none is set.
+    static float Waveform(float Phase, float PulseWidth, std::uint8_t Control) {
+        float Wave = 1.0f;
+        if ((Control & CONTROL_TRIANGLE) != 0) {
+            Wave = std::min(Wave, 1.0f - 4.0f * std::fabs(Phase - 0.5f));
+        }
+        if ((Control & CONTROL_SAW) != 0) {
+            Wave = std::min(Wave, 2.0f * Phase - 1.0f);
+        }
+        if ((Control & CONTROL_PULSE) != 0) {
+            Wave = std::min(Wave, Phase >= PulseWidth ? 1.0f : -1.0f);
+        }
+        return Wave;
+    }
+
+    // Adds Count samples of a triangle/saw/pulse voice scaled by Envelope to Out.
+    // @return the phase after the last sample.
+    static float OscillateScalar(float* Out, const float* Envelope, std::uint32_t Count, float Phase, float Increment, float PulseWidth, std::uint8_t Control) {
+        if ((Control & (CONTROL_TRIANGLE | CONTROL_SAW | CONTROL_PULSE)) == 0) {
+            return Advance(Phase, Increment, Count);
+        }
+        for (std::uint32_t i = 0; i < Count; i++) {
+            float Position = Phase + Increment * (i + 1);
+            Position -= std::floor(Position);
+            Out[i] += Waveform(Position, PulseWidth, Control) * Envelope[i];
+        }
+        return Advance(Phase, Increment, Count);
+    }
+
+#if defined(CPU_SOUND_AVX2)
+    // AVX2 version of OscillateScalar: eight samples per iteration.
+    __attribute__((target("avx2,fma")))
+    static float OscillateAVX2(float* Out, const float* Envelope, std::uint32_t Count, float Phase, float Increment, float PulseWidth, std::uint8_t Control) {
+        if ((Control & (CONTROL_TRIANGLE | CONTROL_SAW | CONTROL_PULSE)) == 0) {
+            return Advance(Phase, Increment, Count);
+        }
+        const __m256 Offsets = _mm256_setr_ps(1, 2, 3, 4, 5, 6, 7, 8);
+        const __m256 One = _mm256_set1_ps(1.0f);
+        const __m256 Half = _mm256_set1_ps(0.5f);
+        const __m256 Four = _mm256_set1_ps(4.0f);
+        const __m256 Two = _mm256_set1_ps(2.0f);
+        const __m256 SignMask = _mm256_set1_ps(-0.0f);
+        const __m256 Step = _mm256_set1_ps(Increment);
+        const __m256 Start = _mm256_set1_ps(Phase);
+        const __m256 Width = _mm256_set1_ps(PulseWidth);
+        std::uint32_t i = 0;
+        for (; i + 8 <= Count; i += 8) {
+            __m256 Position = _mm256_fmadd_ps(_mm256_add_ps(_mm256_set1_ps(static_cast<float>(i)), Offsets), Step, Start);
+            Position = _mm256_sub_ps(Position, _mm256_floor_ps(Position));
+            __m256 Wave = One;
+            if ((Control & CONTROL_TRIANGLE) != 0) {
+                __m256 Distance = _mm256_andnot_ps(SignMask, _mm256_sub_ps(Position, Half));
+                Wave = _mm256_min_ps(Wave, _mm256_fnmadd_ps(Four, Distance, One));
+            }
+            if ((Control & CONTROL_SAW) != 0) {
+                Wave = _mm256_min_ps(Wave, _mm256_fmsub_ps(Two, Position, One));
+            }
+            if ((Control & CONTROL_PULSE) != 0) {
+                __m256 High = _mm256_cmp_ps(Position, Width, _CMP_GE_OQ);
+                Wave = _mm256_min_ps(Wave, _mm256_blendv_ps(_mm256_xor_ps(One, SignMask), One, High));
+            }
+            __m256 Sum = _mm256_fmadd_ps(Wave, _mm256_loadu_ps(Envelope + i), _mm256_loadu_ps(Out + i));
+            _mm256_storeu_ps(Out + i, Sum);
+        }
+        for (; i < Count; i++) {
+            float Position = Phase + Increment * (i + 1);
+            Position -= std::floor(Position);
+            Out[i] += Waveform(Position, PulseWidth, Control) * Envelope[i];
+        }
+        return Advance(Phase, Increment, Count);
+    }
+
+    static bool UseAVX2() {
+        static const bool Supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        return Supported;
+    }
+#else
+    static float OscillateAVX2(float* Out, const float* Envelope, std::uint32_t Count, float Phase, float Increment, float PulseWidth, std::uint8_t Control) {
+        return OscillateScalar(Out, Envelope, Count, Phase, Increment, PulseWidth, Control);
+    }
+
+    static bool UseAVX2() {
+        return false;
+    }
+#endif
+};
+
+
+// This struct holds the cycle windows in which devices hold the RDY line low (DMA, video badlines)
+// and the CPU is stalled. Devices declare windows ahead of time with Steal; CPU::Execute keeps the
+// start of the next window as a single deadline and, once an instruction boundary reaches it,
+// charges the whole window to the budget at once instead of testing RDY every cycle. A window that
+// starts inside an instruction is charged at the end of that instruction, so cycle totals are exact
+// while the instruction itself completes up to a few cycles early. Not thread-safe: declare
+// windows between Execute calls (or from a device driven by the CPU thread).
+struct StallSchedule {
+    // This struct is one stall window.
+    struct Window {
+        std::uint64_t Start;            // First stalled cycle
+        std::uint32_t Length;           // Number of stalled cycles
+    };
+
+    // Windows sorted by Start.
+    std::deque<Window> Windows;
+
+    // Declares that the CPU is stalled for Length cycles from cycle Start.
+    void Steal(std::uint64_t Start, std::uint32_t Length) {
+        if (Length == 0) {
+            return;
+        }
+        Window Entry{ Start, Length };
+        auto Position = std::upper_bound(Windows.begin(), Windows.end(), Entry, [](const Window& Left, const Window& Right) {
+            return Left.Start < Right.Start;
+        });
+        Windows.insert(Position, Entry);
+    }
+
+    // @return the start of the next window, or UINT64_MAX if none is scheduled.
+    std::uint64_t Next() const {
+        return Windows.empty() ? UINT64_MAX : Windows.front().Start;
+    }
+
+    // Removes the windows that have started by Now and returns their stalled cycles, at most
+    // Limit. A window cut short by Limit keeps its remainder, due immediately.
+    std::uint32_t Take(std::uint64_t Now, std::uint32_t Limit) {
+        std::uint32_t Stolen = 0;
+        while (!Windows.empty() && Windows.front().Start <= Now && Stolen < Limit) {
+            Window& Front = Windows.front();
+            std::uint32_t Part = std::min(Front.Length, Limit - Stolen);
+            Stolen += Part;
+            Front.Length -= Part;
+            if (Front.Length == 0) {
+                Windows.pop_front();
+            } else {
+                Front.Start = Now + Stolen;
+            }
+        }
+        return Stolen;
+    }
+};
+
+
+// *** THREADED DEVICES ***
+// A device can run on its own host thread, exchanging cycle-stamped messages with the CPU through
+// lock-free mailboxes. Synchronisation is conservative: each device declares a Lookahead, the
+// minimum number of cycles between a cause at device time t and its earliest effect on the CPU
+// (an InputEvent stamped >= t + Lookahead, raised through DeviceLink::Raise in stamp order). The
+// CPU runs in windows on a fixed grid (see RunWithDevices) and only starts a window once every
+// device has caught up far enough that no effect inside the window can still be produced. Each
+// device has its own return queue and InputPort delivers the smallest stamp across them, so
+// window boundaries and delivery order depend on cycle counts alone, never on thread timing, and
+// runs stay deterministic with any number of devices (see main --check-devices).
+
+// One message from the CPU to a threaded device.
+struct DeviceMessage {
+    enum : std::uint8_t {
+        WRITE,                  // Register write at Cycle
+        SYNC,                   // No more writes before Cycle: advance to it
+        STOP,                   // Leave the device thread
+    };
+    std::uint64_t Cycle;
+    std::uint16_t Address;
+    std::uint8_t Value;
+    std::uint8_t Kind;
+};
+
+// This struct is the CPU's side of one threaded device (see DeviceThread).
+struct DeviceLink {
+    static constexpr std::size_t CAPACITY = 4096;
+
+    SpscQueue<DeviceMessage, CAPACITY> ToDevice;
+    // Effects on the CPU, in non-decreasing Cycle order (registered with InputPort::Devices).
+    InputPort::Queue ToCpu;
+    // Every message up to this cycle has been handled and its effects on the CPU are queued.
+    alignas(64) std::atomic<std::uint64_t> Horizon { 0 };
+    // Cycles between a cause in the device and its earliest effect on the CPU
+    // (UINT32_MAX for devices that never affect the CPU).
+    std::uint32_t Lookahead = UINT32_MAX;
+    // Addresses routed to the device: (Address & Mask) == Base.
+    std::uint16_t Base = 0;
+    std::uint16_t Mask = 0xFFFF;
+
+    bool Maps(std::uint16_t Address) const {
+        return (Address & Mask) == Base;
+    }
+
+    // Queues a message, waiting while the mailbox is full. CPU thread only.
+    void Send(const DeviceMessage& Message) {
+        while (!ToDevice.Push(Message)) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Queues an effect on the CPU, waiting while the return queue is full. Device thread only.
+    void Raise(const InputEvent& Event) {
+        while (!ToCpu.Push(Event)) {
+            std::this_thread::yield();
+        }
+    }
+};
+
+// This struct routes CPU writes to the threaded devices and tracks how far each has run.
+struct DeviceBus {
+    // Upper bound of a window, so devices that never affect the CPU still advance regularly.
+    static constexpr std::uint32_t MAX_WINDOW = 20000;
+
+    std::vector<DeviceLink*> Links;     // Not owned
+
+    // Registers the return queue of every device that can affect the CPU with Port.
+    void Attach(InputPort& Port) {
+        for (DeviceLink* Link : Links) {
+            if (Link->Lookahead != UINT32_MAX) {
+                Port.Devices.push_back(&Link->ToCpu);
+            }
+        }
+    }
+
+    // Removes the queues added by Attach.
+    void Detach(InputPort& Port) {
+        for (DeviceLink* Link : Links) {
+            Port.Devices.erase(std::remove(Port.Devices.begin(), Port.Devices.end(), &Link->ToCpu), Port.Devices.end());
+        }
+    }
+
+    // Forwards a write at Cycle to every device that maps Address.
+    void Write(std::uint64_t Cycle, std::uint16_t Address, std::uint8_t Value) {
+        for (DeviceLink* Link : Links) {
+            if (Link->Maps(Address)) {
+                Link->Send({ Cycle, Address, Value, DeviceMessage::WRITE });
+            }
+        }
+    }
+
+    // Length of the CPU's windows: half the smallest lookahead, so a device may lag the CPU by a
+    // window and both run concurrently.
+    std::uint32_t Window() const {
+        std::uint32_t Length = MAX_WINDOW;
+        for (const DeviceLink* Link : Links) {
+            Length = std::min(Length, std::max(1u, Link->Lookahead / 2));
+        }
+        return Length;
+    }
+
+    // Tells every device that the CPU has reached Cycle.
+    void Sync(std::uint64_t Cycle) {
+        for (DeviceLink* Link : Links) {
+            Link->Send({ Cycle, 0, 0, DeviceMessage::SYNC });
+        }
+    }
+
+    // Waits until no device can still produce an effect on the CPU before cycle End.
+    void WaitForWindow(std::uint64_t End) const {
+        for (const DeviceLink* Link : Links) {
+            if (End <= Link->Lookahead) {
+                continue;
+            }
+            while (Link->Horizon.load(std::memory_order_acquire) + Link->Lookahead < End) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // Waits until every device has handled everything up to Cycle.
+    void Drain(std::uint64_t Cycle) const {
+        for (const DeviceLink* Link : Links) {
+            while (Link->Horizon.load(std::memory_order_acquire) < Cycle) {
+                std::this_thread::yield();
+            }
+        }
+    }
+};
+
+// Detects a device's optional Attach(DeviceLink&), through which it raises effects on the CPU.
+template <typename Device, typename = void>
+struct RaisesEvents : std::false_type {};
+template <typename Device>
+struct RaisesEvents<Device, std::void_t<decltype(std::declval<Device&>().Attach(std::declval<DeviceLink&>()))>> : std::true_type {};
+
+// This struct runs a device on its own thread, fed through a DeviceLink. Device provides
+// Write(Cycle, Address, Value) and Sync(Cycle), like SoundDevice, and is only touched by the
+// thread until the DeviceThread is destroyed. A device that affects the CPU also provides
+// Attach(DeviceLink&) and raises its events through the link.
+template <typename Device>
+struct DeviceThread {
+    Device& Target;
+    DeviceLink Link;
+    std::thread Worker;
+
+    DeviceThread(Device& target, std::uint16_t Base, std::uint16_t Mask, std::uint32_t Lookahead) : Target(target) {
+        Link.Base = Base;
+        Link.Mask = Mask;
+        Link.Lookahead = Lookahead;
+        if constexpr (RaisesEvents<Device>::value) {
+            Target.Attach(Link);
+        }
+        Worker = std::thread([this]() { Loop(); });
+    }
+
+    ~DeviceThread() {
+        Link.Send({ 0, 0, 0, DeviceMessage::STOP });
+        Worker.join();
+    }
+
+    void Loop() {
+        for (;;) {
+            const DeviceMessage* Message = Link.ToDevice.Peek();
+            if (Message == nullptr) {
+                std::this_thread::yield();
+                continue;
+            }
+            DeviceMessage Current = *Message;
+            Link.ToDevice.Pop();
+            switch (Current.Kind) {
+                case DeviceMessage::WRITE:
+                    Target.Write(Current.Cycle, Current.Address, Current.Value);
+                    break;
+                case DeviceMessage::SYNC:
+                    Target.Sync(Current.Cycle);
+                    Link.Horizon.store(Current.Cycle, std::memory_order_release);
+                    break;
+                case DeviceMessage::STOP:
+                    return;
+            }
+        }
+    }
+};
+
+
+// Kinds of memory access reported to instrumentation.
+enum AccessKind : std::uint8_t {
+    ACCESS_READ,
+    ACCESS_WRITE,
+    ACCESS_EXECUTE,             // Opcode and operand fetches
+};
+
+// This struct describes one instruction executed by CPU::Step.
+struct StepRecord {
+    static constexpr std::uint32_t MAX_ACCESSES = 16;
+
+    // This struct is one memory access made by the instruction.
+    struct Access {
+        std::uint16_t Address;
+        std::uint8_t Value;
+        AccessKind Kind;
+    };
+
+    std::uint16_t PC = 0;               // Address of the instruction
+    std::uint8_t Opcode = 0;
+    bool Interrupted = false;           // An interrupt was entered before the instruction
+    std::uint32_t Cycles = 0;           // Cycles taken, including interrupt entry
+    std::uint32_t AccessCount = 0;
+    Access Accesses[MAX_ACCESSES];
+
+    void Add(AccessKind Kind, std::uint16_t Address, std::uint8_t Value) {
+        if (AccessCount < MAX_ACCESSES) {
+            Accesses[AccessCount++] = { Address, Value, Kind };
+        }
+    }
+};
+
+
+// This struct is the CPU state Execute touches on every instruction: registers, the packed status
+// byte, the cycle counter and the pending-interrupt word, in one 64-byte cache line with no
+// implicit padding. Copying it is a one-line snapshot and SameState compares it in a few vector
+// compares. The memory is not part of it: Execute is handed its Mem on each call, and a stored
+// pointer would follow neither Machine copies nor snapshot restores.
+struct alignas(64) CPUState {
+    // Total number of cycles executed since the last Reset.
+    std::uint64_t TotalCycles;
+
+    // Interrupt lines asserted but not yet serviced (INTERRUPT_IRQ | INTERRUPT_NMI).
+    // Other threads set bits with AssertIRQ/AssertNMI; Execute polls the word once per instruction.
+    // It is a plain word accessed through atomic builtins so that CPU stays trivially copyable.
+    std::uint32_t PendingInterrupts;
+
+    std::uint16_t PC, SP;       // Program Counter & Stack Pointer
+    std::uint8_t A, X, Y;       // Accumulator, Index X & Y registers
+    std::uint8_t P;             // Processor status NV-BDIZC (bit 5 reads as 1, see GetStatus)
+
+    // Always zero, so the whole line can be compared bytewise.
+    std::uint8_t Reserved[44];
+
+    // Status flag bits of P.
+    static constexpr std::uint8_t
+        FLAG_C = 0b00000001,    // Carry Status flag
+        FLAG_Z = 0b00000010,    // Zero flag
+        FLAG_I = 0b00000100,    // Interrupt Disable flag
+        FLAG_D = 0b00001000,    // Decimal Mode flag
+        FLAG_B = 0b00010000,    // Break Command flag
+        FLAG_UNUSED = 0b00100000,
+        FLAG_V = 0b01000000,    // Overflow flag
+        FLAG_N = 0b10000000;    // Negative flag
+
+    bool Flag(std::uint8_t Mask) const {
+        return (P & Mask) != 0;
+    }
+
+    void SetFlag(std::uint8_t Mask, bool Value) {
+        P = static_cast<std::uint8_t>(Value ? (P | Mask) : (P & ~Mask));
+    }
+
+    // @return true if Other holds the same registers, flags, cycle count and pending interrupts.
+    bool SameState(const CPUState& Other) const {
+#if defined(__SSE2__)
+        const __m128i* Left = reinterpret_cast<const __m128i*>(this);
+        const __m128i* Right = reinterpret_cast<const __m128i*>(&Other);
+        __m128i Equal = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(Left[0], Right[0]), _mm_cmpeq_epi8(Left[1], Right[1])),
+                                      _mm_and_si128(_mm_cmpeq_epi8(Left[2], Right[2]), _mm_cmpeq_epi8(Left[3], Right[3])));
+        return _mm_movemask_epi8(Equal) == 0xFFFF;
+#else
+        return std::memcmp(this, &Other, sizeof(CPUState)) == 0;
+#endif
+    }
+};
+
+static_assert(sizeof(CPUState) == 64 && alignof(CPUState) == 64, "CPUState must be exactly one cache line");
+static_assert(std::is_trivially_copyable_v<CPUState>, "CPUState is copied and compared bytewise");
+static_assert(std::is_standard_layout_v<CPUState> && offsetof(CPUState, Reserved) + sizeof(CPUState::Reserved) == sizeof(CPUState),
+              "CPUState must have no implicit padding");
+
+
+// This struct represents a CPU.
+// The hot state (CPUState) is the base class, so it sits in the first cache line and is read as
+// cpu.PC, cpu.P and so on; the hooks that follow are only dereferenced when set.
+struct CPU : CPUState {
+    // The default constructor leaves the registers uninitialised; call Reset before Execute.
+    CPU() = default;
+
+    // Constant-initialises a CPU in its post-reset state with PC at EntryPoint.
+    // Unlike Reset, this does not touch memory.
+    constexpr explicit CPU(std::uint16_t EntryPoint)
+        : CPUState{ 0, 0, EntryPoint, 0x0100, 0, 0, 0, 0, {} } {}
+
+    // When set, Execute returns as soon as the first instruction of an interrupt handler has run,
+    // truncating the rest of the cycle budget, so the caller can react with bounded latency.
+    bool ReturnAfterInterrupt = false;
+
+    // Optional call-stack trace output (nullptr when tracing is off).
+    TraceWriter* Trace = nullptr;
+    // Optional per-address access counters (nullptr when disabled).
+    MemHeatmap* Heatmap = nullptr;
+    // Record of the instruction being run by Step (nullptr otherwise).
+    StepRecord* Recording = nullptr;
+    // Optional sound device at $D400 (nullptr when absent).
+    SoundDevice* Sound = nullptr;
+    // Optional RDY/DMA stall windows (nullptr when nothing steals cycles).
+    StallSchedule* Stalls = nullptr;
+    // Optional threaded devices (see RunWithDevices; nullptr when none).
+    DeviceBus* Bus = nullptr;
+    // Optional external input drained during Execute (nullptr when unused).
+    InputPort* Input = nullptr;
+
+    // Clears every optional hook, e.g. for a CPU copied from another process or thread.
+    void DetachHooks() {
+        Trace = nullptr;
+        Heatmap = nullptr;
+        Recording = nullptr;
+        Sound = nullptr;
+        Stalls = nullptr;
+        Bus = nullptr;
+        Input = nullptr;
+    }
+
+    // This function resets the CPU state.
+    void Reset(Mem& memory) {
+        // Reset program counter to 0xFFFC.
+        PC = 0xFFFC;
+        // Reset stack pointer to 0x0100.
+        SP = 0x0100;
+        // Reset all flags to 0.
+        P = 0;
+        // Reset all registers to 0.
+        A = X = Y = 0;
+        // Reset the cycle counter.
+        TotalCycles = 0;
+        // Drop any pending interrupts.
+        __atomic_store_n(&PendingInterrupts, 0, __ATOMIC_RELAXED);
+        std::memset(Reserved, 0, sizeof(Reserved));
+        // Initialize memory.
+        memory.Initialise();
+    }
+
+    // Reports one memory access to the enabled instrumentation.
+    void Observe(AccessKind Kind, std::uint16_t Address, std::uint8_t Value) {
+        if (Heatmap != nullptr) {
+            switch (Kind) {
+                case ACCESS_READ: Heatmap->CountRead(Address); break;
+                case ACCESS_WRITE: Heatmap->CountWrite(Address); break;
+                case ACCESS_EXECUTE: Heatmap->CountExecute(Address); break;
+            }
+        }
+        if (Recording != nullptr) {
+            Recording->Add(Kind, Address, Value);
+        }
+    }
+
+    // Fetches a byte from memory at the current program counter (PC) and updates the necessary variables.
+    // @param Cycles The number of cycles taken by the operation (updated by reference).
+    // @param memory The memory block from which to fetch the byte.
+    // @return The fetched byte value.
+    std::uint8_t FetchByte(std::uint32_t& Cycles, Mem& memory) {
+        // Fetch byte from memory at the current program counter (PC).
+        std::uint8_t Data = memory[PC];
+        Observe(ACCESS_EXECUTE, PC, Data);
+        // Increment program counter (PC).
+        PC++;
+        // Decrement cycle count.
+        Cycles--;
+        // Return fetched byte.
+        return Data;
+    }
+
+    std::uint16_t FetchWord(std::uint32_t& Cycles, Mem& memory) {
+        // Fetch word from memory at the current program counter (PC)
+        // 6502 is little endian
+        std::uint16_t Data = memory[PC];
+        Observe(ACCESS_EXECUTE, PC, static_cast<std::uint8_t>(Data));
+        // Increment program counter (PC).
+        PC++;
+
+        Data |= (memory[PC] << 8);
+        Observe(ACCESS_EXECUTE, PC, static_cast<std::uint8_t>(Data >> 8));
+        // Increment program counter (PC).
+        PC++;
+        // Decrement cycle count.
+        Cycles -= 2;
+        // Return fetched byte.
+
+        return Data;
+    }
+
+    // Fetches a byte from memory at the current Address and updates the necessary variables.
+    // @param Cycles The number of cycles taken by the operation (updated by reference).
+    // @param memory The memory block from which to fetch the byte.
+    // @return The fetched byte value.
+    std::uint8_t ReadByte(std::uint32_t& Cycles, std::uint16_t Address, Mem& memory) {
+        // A 16-bit address is always inside Mem, which asserts on its own like FetchByte relies on.
+        // Fetch byte from memory at the current Address
+        std::uint8_t Data = memory[Address];
+        Observe(ACCESS_READ, Address, Data);
+        // Decrement cycle count.
+        Cycles--;
+        // Return fetched byte.
+        return Data;
+    }
+
+    // Pushes a 16-bit value onto the stack (the stack grows upwards from SP).
+    void PushWordToStack(std::uint32_t& Cycles, Mem& memory, std::uint16_t Value) {
+        memory.WriteWord(Value, SP, Cycles);
+        Observe(ACCESS_WRITE, SP, static_cast<std::uint8_t>(Value));
+        Observe(ACCESS_WRITE, SP + 1, static_cast<std::uint8_t>(Value >> 8));
+        SP += 2;
+    }
+
+    // Pops a 16-bit value pushed by PushWordToStack.
+    std::uint16_t PopWordFromStack(std::uint32_t& Cycles, Mem& memory) {
+        SP -= 2;
+        std::uint16_t Value = memory[SP] | (memory[SP + 1] << 8);
+        Observe(ACCESS_READ, SP, static_cast<std::uint8_t>(Value));
+        Observe(ACCESS_READ, SP + 1, static_cast<std::uint8_t>(Value >> 8));
+        Cycles -= 2;
+        return Value;
+    }
+
+    // Pushes one byte onto the stack.
+    void PushByteToStack(std::uint32_t& Cycles, Mem& memory, std::uint8_t Value) {
+        memory[SP] = Value;
+        Observe(ACCESS_WRITE, SP, Value);
+        SP++;
+        Cycles--;
+    }
+
+    // Pops a byte pushed by PushByteToStack.
+    std::uint8_t PopByteFromStack(std::uint32_t& Cycles, Mem& memory) {
+        SP--;
+        std::uint8_t Value = memory[SP];
+        Observe(ACCESS_READ, SP, Value);
+        Cycles--;
+        return Value;
+    }
+
+    // The processor status byte (NV-BDIZC, bit 5 always set).
+    std::uint8_t GetStatus() const {
+        return P | FLAG_UNUSED;
+    }
+
+    // Loads a status byte pulled from the stack (PLP, RTI): B and bit 5 are not flags and keep
+    // their value.
+    void PullStatus(std::uint8_t Status) {
+        P = static_cast<std::uint8_t>((Status & ~(FLAG_B | FLAG_UNUSED)) | (P & FLAG_B));
+    }
+
+    // *** INTERRUPTS ***
+    static constexpr std::uint32_t
+        INTERRUPT_IRQ = 1,
+        INTERRUPT_NMI = 2;
+    static constexpr std::uint16_t
+        NMI_VECTOR = 0xFFFA,
+        IRQ_VECTOR = 0xFFFE;
+    // Cycles taken by interrupt entry: two internal cycles, pushing PC and status, and loading
+    // the vector (ServiceInterrupt charges exactly this).
+    static constexpr std::uint32_t INTERRUPT_CYCLES = 7;
+
+    // Asserts the IRQ line. Safe to call from any thread while Execute is running.
+    void AssertIRQ() {
+        __atomic_fetch_or(&PendingInterrupts, INTERRUPT_IRQ, __ATOMIC_RELEASE);
+    }
+
+    // Asserts the NMI line. Safe to call from any thread while Execute is running.
+    void AssertNMI() {
+        __atomic_fetch_or(&PendingInterrupts, INTERRUPT_NMI, __ATOMIC_RELEASE);
+    }
+
+    // Enters the handler for the highest-priority pending interrupt.
+    // An IRQ stays pending while the Interrupt Disable flag is set.
+    // @return The vector address used, or 0 if nothing was serviced.
+    std::uint16_t ServiceInterrupt(std::uint32_t& Cycles, Mem& memory) {
+        std::uint32_t Pending = __atomic_load_n(&PendingInterrupts, __ATOMIC_ACQUIRE);
+        std::uint32_t Taken;
+        std::uint16_t Vector;
+        if (Pending & INTERRUPT_NMI) {
+            Taken = INTERRUPT_NMI;
+            Vector = NMI_VECTOR;
+        } else if ((Pending & INTERRUPT_IRQ) && !Flag(FLAG_I)) {
+            Taken = INTERRUPT_IRQ;
+            Vector = IRQ_VECTOR;
+        } else {
+            return 0;
+        }
+        __atomic_fetch_and(&PendingInterrupts, ~Taken, __ATOMIC_ACQ_REL);
+        // Probe: interrupt(kind, PC at the time of the interrupt)
+        CPU_PROBE2(interrupt, Taken, PC);
+        // Two internal cycles, in which the 6502 fetches and discards the next opcode.
+        Cycles -= 2;
+        PushWordToStack(Cycles, memory, PC);
+        PushByteToStack(Cycles, memory, static_cast<std::uint8_t>(GetStatus() & ~FLAG_B));
+        P |= FLAG_I;
+        PC = memory[Vector] | (memory[Vector + 1] << 8);
+        Observe(ACCESS_READ, Vector, static_cast<std::uint8_t>(PC));
+        Observe(ACCESS_READ, Vector + 1, static_cast<std::uint8_t>(PC >> 8));
+        Cycles -= 2;
+        return Vector;
+    }
+
+    // Delivers every input event due by cycle Now.
+    void DeliverInput(std::uint64_t Now, Mem& memory) {
+        while (const InputEvent* Event = Input->NextDue(Now)) {
+            switch (Event->Kind) {
+                case InputEvent::WRITE_BYTE:
+                    memory[Event->Address] = Event->Value;
+                    Observe(ACCESS_WRITE, Event->Address, Event->Value);
+                    if (Sound != nullptr && SoundDevice::Maps(Event->Address)) {
+                        Sound->Write(Now, Event->Address, Event->Value);
+                    }
+                    if (Bus != nullptr) {
+                        Bus->Write(Now, Event->Address, Event->Value);
+                    }
+                    break;
+                case InputEvent::ASSERT_IRQ:
+                    AssertIRQ();
+                    break;
+                case InputEvent::ASSERT_NMI:
+                    AssertNMI();
+                    break;
+            }
+            if (Input->Record != nullptr) {
+                InputEvent Delivered = *Event;
+                Delivered.Cycle = Now;
+                Input->Record->push_back(Delivered);
+            }
+            Input->PopDue();
+        }
+    }
+
+    // *** OPCODES ***
+    // LDA
+    static constexpr std::uint8_t
+        INS_LDA_IM = 0xA9,  // Immediate  
+        INS_LDA_ZP = 0xA5,  // Zero Page
+        INS_LDA_ZPX = 0xB5, // Zero Page X
+        INS_JSR = 0x20,     // JSR
+        INS_RTS = 0x60,     // RTS
+        INS_RTI = 0x40,     // RTI
+        INS_PHP = 0x08,     // PHP
+        INS_PLP = 0x28;     // PLP
+
+    void LDASetStatus() {
+        // Set zero flag (Z) if accumulator is 0 and negative flag (N) if its most significant bit
+        // is set; both in one write of the packed status byte.
+        P = static_cast<std::uint8_t>((P & ~(FLAG_Z | FLAG_N)) | (A == 0 ? FLAG_Z : 0) | (A & FLAG_N));
+    }
+
+    // Returns false for opcodes compiled out of a ROM-specialised build (see main --specialize).
+    // Their handlers are removed and the opcode is treated like any unknown instruction.
+    static constexpr bool OpcodeEnabled(std::uint8_t Opcode) {
+#if defined(CPU_SPECIALIZED_OPCODES)
+        constexpr std::uint8_t Enabled[] = { CPU_SPECIALIZED_OPCODES };
+        for (std::uint8_t EnabledOpcode : Enabled) {
+            if (EnabledOpcode == Opcode) {
+                return true;
+            }
+        }
+        return false;
+#else
+        (void)Opcode;
+        return true;
+#endif
+    }
+
+    // Handles an instruction that is not implemented (or not enabled in this build).
+    // Kept out of line so the dispatch loop stays small.
+    __attribute__((noinline, cold)) void UnknownOpcode(std::uint8_t Instruction) {
+        // Probe: unknown_opcode(address of the opcode, opcode)
+        CPU_PROBE2(unknown_opcode, static_cast<std::uint16_t>(PC - 1), Instruction);
+        std::cout << "Instruction not handled " << static_cast<int>(Instruction) << std::endl;
+    }
+
+    // Runs one instruction, including the input delivery and interrupt poll in front of it.
+    // The current cycle is TotalCycles + (Budget - Cycles); TotalCycles is left for the caller.
+    // Returns true when an interrupt was entered. Shared by Execute and Step so both use the same
+    // dispatch code; forced inline so Execute's loop compiles exactly as before.
+    __attribute__((always_inline)) inline bool ExecuteOne(std::uint32_t& Cycles, std::uint32_t Budget, Mem& memory) {
+        bool Interrupted = false;
+        // Deliver due external input before the instruction that may observe it.
+        if (Input != nullptr) {
+            DeliverInput(TotalCycles + (Budget - Cycles), memory);
+        }
+        // Poll the interrupt lines once per instruction.
+        if (__atomic_load_n(&PendingInterrupts, __ATOMIC_RELAXED) != 0 && Cycles > INTERRUPT_CYCLES) {
+            std::uint16_t Vector = ServiceInterrupt(Cycles, memory);
+            if (Vector != 0) {
+                if (Trace != nullptr) {
+                    Trace->Begin(TotalCycles + (Budget - Cycles), PC);
+                }
+                Interrupted = true;
+            }
+        }
+        // Fetch next instruction from memory.
+        std::uint16_t InstructionPC = PC;
+        std::uint8_t Instruction = FetchByte(Cycles, memory);
+        if (Recording != nullptr) {
+            // Taken at the fetch itself: input writes may already have filled the access log.
+            Recording->PC = InstructionPC;
+            Recording->Opcode = Instruction;
+        }
+        switch (Instruction) {
+            case INS_LDA_IM: {
+                if constexpr (!OpcodeEnabled(INS_LDA_IM)) { UnknownOpcode(Instruction); break; }
+                // Load value from immediate into the accumulator (A).
+                std::uint8_t Value = FetchByte(Cycles, memory);
+                A = Value;
+                LDASetStatus();
+            } break;
+            case INS_LDA_ZP:    {
+                if constexpr (!OpcodeEnabled(INS_LDA_ZP)) { UnknownOpcode(Instruction); break; }
+                // Load value from immediate into the accumulator (A).
+                std::uint8_t ZeroPageAddress = FetchByte(Cycles, memory);
+                A = ReadByte(Cycles, ZeroPageAddress, memory);
+                LDASetStatus();
+            } break;
+            case INS_LDA_ZPX:    {
+                if constexpr (!OpcodeEnabled(INS_LDA_ZPX)) { UnknownOpcode(Instruction); break; }
+                // Load value from immediate into the accumulator (A).
+                std::uint8_t ZeroPageAddress = FetchByte(Cycles, memory);
+                ZeroPageAddress += X;
+                Cycles--;
+                A = ReadByte(Cycles, ZeroPageAddress, memory);
+                LDASetStatus();
+            } break;
+            case INS_JSR:   {
+                if constexpr (!OpcodeEnabled(INS_JSR)) { UnknownOpcode(Instruction); break; }
+                std::uint16_t SubAddr = FetchWord(Cycles, memory);
+                PushWordToStack(Cycles, memory, PC - 1);
+                PC = SubAddr;
+                Cycles --;
+                if (Trace != nullptr) {
+                    Trace->Begin(TotalCycles + (Budget - Cycles), SubAddr);
+                }
+            } break;
+            case INS_RTS:   {
+                if constexpr (!OpcodeEnabled(INS_RTS)) { UnknownOpcode(Instruction); break; }
+                std::uint16_t ReturnAddr = PopWordFromStack(Cycles, memory);
+                PC = ReturnAddr + 1;
+                Cycles -= 3;
+                if (Trace != nullptr) {
+                    Trace->End(TotalCycles + (Budget - Cycles));
+                }
+            } break;
+            case INS_RTI:   {
+                if constexpr (!OpcodeEnabled(INS_RTI)) { UnknownOpcode(Instruction); break; }
+                PullStatus(PopByteFromStack(Cycles, memory));
+                PC = PopWordFromStack(Cycles, memory);
+                Cycles -= 2;
+                if (Trace != nullptr) {
+                    Trace->End(TotalCycles + (Budget - Cycles));
+                }
+            } break;
+            case INS_PHP:   {
+                if constexpr (!OpcodeEnabled(INS_PHP)) { UnknownOpcode(Instruction); break; }
+                // Push the status byte; PHP always pushes B set.
+                PushByteToStack(Cycles, memory, GetStatus() | FLAG_B);
+                Cycles--;
+            } break;
+            case INS_PLP:   {
+                if constexpr (!OpcodeEnabled(INS_PLP)) { UnknownOpcode(Instruction); break; }
+                PullStatus(PopByteFromStack(Cycles, memory));
+                Cycles -= 2;
+            } break;
+            default: {
+                UnknownOpcode(Instruction);
+            } break;
+        }
+        return Interrupted;
+    }
+
+    // @return the offset from the start of the current Execute call (TotalCycles) of the next
+    // stall window, or UINT32_MAX if there is none.
+    std::uint32_t NextStall() const {
+        if (Stalls == nullptr) {
+            return UINT32_MAX;
+        }
+        std::uint64_t Next = Stalls->Next();
+        if (Next == UINT64_MAX) {
+            return UINT32_MAX;
+        }
+        return Next <= TotalCycles ? 0 : static_cast<std::uint32_t>(std::min<std::uint64_t>(Next - TotalCycles, UINT32_MAX));
+    }
+
+    // This function executes the CPU instructions for the given number of cycles.
+    void Execute(std::uint32_t Cycles, Mem& memory) {
+        // Remember the budget so the current cycle is TotalCycles + (Budget - Cycles).
+        std::uint32_t Budget = Cycles;
+        // Set when the budget should be truncated after the current instruction.
+        bool StopAfterInstruction = false;
+        // Probe: execute_entry(PC, cycle budget)
+        CPU_PROBE2(execute_entry, PC, Cycles);
+        // Budget offset (Budget - Cycles) of the next stall window; UINT32_MAX when none falls
+        // within reach. One compare per instruction replaces a per-cycle RDY check.
+        std::uint32_t StallAt = NextStall();
+        // Cycles the last instruction ran past the end of the budget.
+        std::uint32_t Overshoot = 0;
+        while (Cycles > 0) {
+            if (Budget - Cycles >= StallAt) {
+                // Stalled cycles pass without executing, up to the end of the budget.
+                Cycles -= Stalls->Take(TotalCycles + (Budget - Cycles), Cycles);
+                StallAt = NextStall();
+                continue;
+            }
+            std::uint32_t Before = Cycles;
+            if (ExecuteOne(Cycles, Budget, memory)) {
+                StopAfterInstruction = ReturnAfterInterrupt;
+            }
+            if (Cycles > Before) {
+                // The instruction overshot the budget and Cycles wrapped "below zero". An
+                // instruction takes only a few cycles, so this test holds for any budget.
+                Overshoot = 0u - Cycles;
+                Cycles = 0;
+                break;
+            }
+            if (StopAfterInstruction) {
+                // Truncate the budget: the unused cycles were never executed.
+                Budget -= Cycles;
+                Cycles = 0;
+            }
+        }
+        TotalCycles += static_cast<std::uint64_t>(Budget - Cycles) + Overshoot;
+        // Let the sound device catch up with the cycles just run.
+        if (Sound != nullptr) {
+            Sound->Sync(TotalCycles);
+        }
+        // Probe: execute_exit(PC, A, X)
+        CPU_PROBE3(execute_exit, PC, A, X);
+    }
+
+    // Budget handed to a single Step; large enough that an interrupt is never deferred for lack of cycles.
+    static constexpr std::uint32_t STEP_BUDGET = 1u << 30;
+
+    // Executes exactly one instruction (plus any due input and interrupt entry in front of it)
+    // through the same dispatch as Execute, and returns what it did.
+    StepRecord Step(Mem& memory) {
+        StepRecord Record;
+        std::uint32_t Cycles = STEP_BUDGET;
+        // A stall window that has started is charged to this step.
+        if (Stalls != nullptr && Stalls->Next() <= TotalCycles) {
+            Cycles -= Stalls->Take(TotalCycles, Cycles);
+        }
+        Recording = &Record;
+        Record.Interrupted = ExecuteOne(Cycles, STEP_BUDGET, memory);
+        Recording = nullptr;
+        Record.Cycles = STEP_BUDGET - Cycles;
+        TotalCycles += Record.Cycles;
+        if (Sound != nullptr) {
+            Sound->Sync(TotalCycles);
+        }
+        return Record;
+    }
+};
+
+
+
+// This struct bundles the CPU and memory of one emulated machine.
+// Both are trivially copyable, so copying a Machine forks it and assigning one restores a snapshot.
+struct Machine {
+    CPU Cpu;
+    Mem Memory;
+
+    // Resets the CPU and clears memory.
+    void Reset() {
+        Cpu.Reset(Memory);
+    }
+};
+
+// Runs machine for Cycles cycles alongside the threaded devices on Bus.
+// The CPU executes windows of Bus.Window() cycles on a fixed grid. Before each window it waits
+// until every device has run far enough that its lookahead covers the window; after it, it sends
+// the devices a SYNC so they can run on concurrently with the next window.
+// Devices that affect the CPU deliver through machine.Cpu.Input, which must then be set.
+void RunWithDevices(Machine& machine, DeviceBus& Bus, std::uint64_t Cycles) {
+    CPU& Cpu = machine.Cpu;
+    Cpu.Bus = &Bus;
+    if (Cpu.Input != nullptr) {
+        Bus.Attach(*Cpu.Input);
+    }
+    std::uint64_t Target = Cpu.TotalCycles + Cycles;
+    std::uint32_t Window = Bus.Window();
+    // Devices may not have seen this machine yet: let them catch up to where it starts.
+    Bus.Sync(Cpu.TotalCycles);
+    while (Cpu.TotalCycles < Target) {
+        std::uint64_t End = std::min<std::uint64_t>(Target, (Cpu.TotalCycles / Window + 1) * Window);
+        Bus.WaitForWindow(End);
+        Cpu.Execute(static_cast<std::uint32_t>(End - Cpu.TotalCycles), machine.Memory);
+        Bus.Sync(Cpu.TotalCycles);
+    }
+    Bus.Drain(Cpu.TotalCycles);
+    if (Cpu.Input != nullptr) {
+        Bus.Detach(*Cpu.Input);
+    }
+    Cpu.Bus = nullptr;
+}
+
+
+// Returns the 64-bit FNV-1a hash of Size bytes at Data.
+inline std::uint64_t HashBytes(const std::uint8_t* Data, std::size_t Size, std::uint64_t Hash = 0xCBF29CE484222325ull) {
+    for (std::size_t i = 0; i < Size; i++) {
+        Hash = (Hash ^ Data[i]) * 0x100000001B3ull;
+    }
+    return Hash;
+}
+
+// This struct interns encoded snapshot pages by content hash so that identical pages held by
+// many parked machines (zero-filled RAM, tables built at boot) are stored once.
+// Pages are immutable and reference counted by id; a page is freed when its last reference is
+// released. Snapshots refer to a page by its 32-bit id, so a shared page costs a reference only
+// a few bytes. All members take Lock, so deduplication can run on a background thread.
+struct PagePool {
+    struct Entry {
+        std::unique_ptr<std::uint8_t[]> Bytes;
+        std::uint32_t Size = 0;
+        std::uint32_t References = 0;
+        std::uint64_t Hash = 0;
+    };
+
+    std::mutex Lock;
+    std::vector<Entry> Entries;
+    // Ids of released entries, reused before Entries grows.
+    std::vector<std::uint32_t> FreeEntries;
+    std::unordered_multimap<std::uint64_t, std::uint32_t> Index;
+
+    // Returns the id of the shared copy of Bytes with one more reference, creating it if no
+    // identical page is live.
+    std::uint32_t Intern(const std::uint8_t* Bytes, std::uint32_t Size) {
+        std::uint64_t Hash = HashBytes(Bytes, Size);
+        std::lock_guard<std::mutex> Guard(Lock);
+        auto Range = Index.equal_range(Hash);
+        for (auto Candidate = Range.first; Candidate != Range.second; ++Candidate) {
+            Entry& Existing = Entries[Candidate->second];
+            if (Existing.Size == Size && std::memcmp(Existing.Bytes.get(), Bytes, Size) == 0) {
+                Existing.References++;
+                return Candidate->second;
+            }
+        }
+        std::uint32_t Id;
+        if (FreeEntries.empty()) {
+            Id = static_cast<std::uint32_t>(Entries.size());
+            Entries.emplace_back();
+        } else {
+            Id = FreeEntries.back();
+            FreeEntries.pop_back();
+        }
+        Entry& Created = Entries[Id];
+        Created.Bytes.reset(new std::uint8_t[Size]);
+        std::memcpy(Created.Bytes.get(), Bytes, Size);
+        Created.Size = Size;
+        Created.References = 1;
+        Created.Hash = Hash;
+        Index.emplace(Hash, Id);
+        return Id;
+    }
+
+    // Drops one reference to page Id, freeing the page when it was the last.
+    void Release(std::uint32_t Id) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Entry& Released = Entries[Id];
+        if (--Released.References > 0) {
+            return;
+        }
+        auto Range = Index.equal_range(Released.Hash);
+        for (auto Candidate = Range.first; Candidate != Range.second; ++Candidate) {
+            if (Candidate->second == Id) {
+                Index.erase(Candidate);
+                break;
+            }
+        }
+        Released.Bytes.reset();
+        Released.Size = 0;
+        FreeEntries.push_back(Id);
+    }
+
+    // Returns the heap footprint of a malloc'd block of Size bytes (glibc: 8-byte header,
+    // 16-byte granularity, 32-byte minimum).
+    static std::size_t HeapBlockBytes(std::size_t Size) {
+        return std::max<std::size_t>(32, (Size + 8 + 15) & ~static_cast<std::size_t>(15));
+    }
+
+    // Returns the number of bytes the pool occupies: the entry table, the hash index (buckets and
+    // nodes) and the page allocations.
+    std::size_t UniqueBytes() {
+        std::lock_guard<std::mutex> Guard(Lock);
+        // An index node holds the key/value pair, the next pointer and the cached hash.
+        static constexpr std::size_t INDEX_NODE = sizeof(decltype(Index)::value_type) + sizeof(void*) + sizeof(std::size_t);
+        std::size_t Total = Entries.capacity() * sizeof(Entry) + FreeEntries.capacity() * sizeof(std::uint32_t) +
+                            Index.bucket_count() * sizeof(void*) + Index.size() * HeapBlockBytes(INDEX_NODE);
+        for (const Entry& Live : Entries) {
+            if (Live.Bytes) {
+                Total += HeapBlockBytes(Live.Size);
+            }
+        }
+        return Total;
+    }
+};
+
+
+// This struct holds a parked (idle) machine compactly.
+// Each 256-byte page is XORed with the same page of a base image (e.g. the freshly booted machine),
+// so unchanged pages vanish and changed pages become mostly-zero deltas. Each delta is then
+// encoded with a small in-tree LZ-style codec:
+//   0x00..0x7F  run of (n + 1) zero bytes
+//   0x80..0xBF  (n & 0x3F) + 1 literal bytes follow
+//   0xC0..0xFF  copy (n & 0x3F) + 3 bytes from 1..256 bytes back (offset - 1 in the next byte)
+// Deduplicate moves the encodings into a PagePool and drops the private page table, leaving
+// only the CPU state and one small reference per changed page.
+struct CompressedSnapshot {
+    static constexpr std::uint32_t PAGE_SIZE = 256;
+    static constexpr std::uint32_t PAGES = Mem::MAX_MEM / PAGE_SIZE;
+
+    // A page held in Pool: page number and pool id.
+    struct SharedPage {
+        std::uint32_t Page;
+        std::uint32_t Id;
+    };
+
+    CPU Cpu;
+    // Page p is encoded in Encoded[PageOffsets[p] .. PageOffsets[p + 1]); empty means "same as base".
+    // Both are empty once the snapshot has been deduplicated.
+    std::vector<std::uint32_t> PageOffsets;
+    std::vector<std::uint8_t> Encoded;
+    // Pages moved into Pool by Deduplicate. Pool must outlive the snapshot.
+    std::vector<SharedPage> SharedPages;
+    PagePool* Pool = nullptr;
+
+    CompressedSnapshot() = default;
+    // Shared page references are owned, so snapshots move but do not copy.
+    CompressedSnapshot(const CompressedSnapshot&) = delete;
+    CompressedSnapshot& operator=(const CompressedSnapshot&) = delete;
+    CompressedSnapshot(CompressedSnapshot&& Other) noexcept {
+        *this = std::move(Other);
+    }
+    CompressedSnapshot& operator=(CompressedSnapshot&& Other) noexcept {
+        if (this != &Other) {
+            ReleaseShared();
+            Cpu = Other.Cpu;
+            PageOffsets = std::move(Other.PageOffsets);
+            Encoded = std::move(Other.Encoded);
+            SharedPages = std::move(Other.SharedPages);
+            Other.SharedPages.clear();
+            Pool = std::exchange(Other.Pool, nullptr);
+        }
+        return *this;
+    }
+    ~CompressedSnapshot() {
+        ReleaseShared();
+    }
+
+    // Stores the state of machine as a delta against Base.
+    void Capture(const Machine& machine, const Mem& Base) {
+        // Probe: snapshot_capture(PC)
+        CPU_PROBE1(snapshot_capture, machine.Cpu.PC);
+        ReleaseShared();
+        Cpu = machine.Cpu;
+        Encoded.clear();
+        PageOffsets.resize(PAGES + 1);
+        for (std::uint32_t Page = 0; Page < PAGES; Page++) {
+            PageOffsets[Page] = static_cast<std::uint32_t>(Encoded.size());
+            const std::uint8_t* Current = &machine.Memory.Data[Page * PAGE_SIZE];
+            const std::uint8_t* Reference = &Base.Data[Page * PAGE_SIZE];
+            // Pages equal to the base (including all-zero pages over a zero base) take no space.
+            if (std::memcmp(Current, Reference, PAGE_SIZE) == 0) {
+                continue;
+            }
+            std::uint8_t Delta[PAGE_SIZE];
+            for (std::uint32_t i = 0; i < PAGE_SIZE; i++) {
+                Delta[i] = Current[i] ^ Reference[i];
+            }
+            EncodePage(Delta, Encoded);
+        }
+        PageOffsets[PAGES] = static_cast<std::uint32_t>(Encoded.size());
+        Encoded.shrink_to_fit();
+    }
+
+    // Rebuilds the machine captured against Base (which must be the same base image).
+    void Restore(Machine& machine, const Mem& Base) const {
+        // Probe: snapshot_restore(PC)
+        CPU_PROBE1(snapshot_restore, Cpu.PC);
+        machine.Cpu = Cpu;
+        if (PageOffsets.empty()) {
+            std::memcpy(machine.Memory.Data, Base.Data, sizeof(Base.Data));
+        } else {
+            for (std::uint32_t Page = 0; Page < PAGES; Page++) {
+                std::uint8_t* Target = &machine.Memory.Data[Page * PAGE_SIZE];
+                const std::uint8_t* Reference = &Base.Data[Page * PAGE_SIZE];
+                if (PageOffsets[Page] == PageOffsets[Page + 1]) {
+                    std::memcpy(Target, Reference, PAGE_SIZE);
+                    continue;
+                }
+                ApplyDelta(&Encoded[PageOffsets[Page]], &Encoded[0] + PageOffsets[Page + 1], Reference, Target);
+            }
+        }
+        if (!SharedPages.empty()) {
+            std::lock_guard<std::mutex> Guard(Pool->Lock);
+            for (const SharedPage& Shared : SharedPages) {
+                std::uint32_t Offset = Shared.Page * PAGE_SIZE;
+                const PagePool::Entry& Bytes = Pool->Entries[Shared.Id];
+                ApplyDelta(Bytes.Bytes.get(), Bytes.Bytes.get() + Bytes.Size, &Base.Data[Offset], &machine.Memory.Data[Offset]);
+            }
+        }
+    }
+
+    // Moves every private page encoding into Target, sharing it with identical pages of other
+    // snapshots, and frees the private page table. Restore is unaffected: it copies shared pages
+    // into the private flat Mem, so a restored machine never writes to a shared page.
+    // Not safe to run concurrently with Capture or Restore of this snapshot (see PageDeduplicator).
+    void Deduplicate(PagePool& Target) {
+        if (PageOffsets.empty()) {
+            return;
+        }
+        Pool = &Target;
+        for (std::uint32_t Page = 0; Page < PAGES; Page++) {
+            if (PageOffsets[Page] != PageOffsets[Page + 1]) {
+                SharedPages.push_back({ Page, Target.Intern(&Encoded[PageOffsets[Page]], PageOffsets[Page + 1] - PageOffsets[Page]) });
+            }
+        }
+        SharedPages.shrink_to_fit();
+        PageOffsets.clear();
+        PageOffsets.shrink_to_fit();
+        Encoded.clear();
+        Encoded.shrink_to_fit();
+    }
+
+    // Drops this snapshot's references to pages in Pool.
+    void ReleaseShared() {
+        for (const SharedPage& Shared : SharedPages) {
+            Pool->Release(Shared.Id);
+        }
+        SharedPages.clear();
+    }
+
+    // Returns the number of bytes this snapshot occupies, including its private heap blocks but
+    // excluding pages shared through a PagePool.
+    std::size_t Bytes() const {
+        std::size_t Total = sizeof(*this);
+        if (PageOffsets.capacity() > 0) {
+            Total += PagePool::HeapBlockBytes(PageOffsets.capacity() * sizeof(PageOffsets[0]));
+        }
+        if (Encoded.capacity() > 0) {
+            Total += PagePool::HeapBlockBytes(Encoded.capacity());
+        }
+        if (SharedPages.capacity() > 0) {
+            Total += PagePool::HeapBlockBytes(SharedPages.capacity() * sizeof(SharedPages[0]));
+        }
+        return Total;
+    }
+
+    // Decodes one encoded delta page and XORs it onto Reference, writing the result to Target.
+    static void ApplyDelta(const std::uint8_t* In, const std::uint8_t* End, const std::uint8_t* Reference, std::uint8_t* Target) {
+        std::uint8_t Delta[PAGE_SIZE];
+        DecodePage(In, End, Delta);
+        for (std::uint32_t i = 0; i < PAGE_SIZE; i++) {
+            Target[i] = Reference[i] ^ Delta[i];
+        }
+    }
+
+    // Encodes one 256-byte delta page and appends it to Out.
+    static void EncodePage(const std::uint8_t* Delta, std::vector<std::uint8_t>& Out) {
+        // Most recent position of each 3-byte hash, for finding matches.
+        std::int16_t Recent[256];
+        std::fill(std::begin(Recent), std::end(Recent), -1);
+        std::uint32_t LiteralStart = 0, LiteralCount = 0;
+        auto FlushLiterals = [&]() {
+            while (LiteralCount > 0) {
+                std::uint32_t Count = std::min<std::uint32_t>(LiteralCount, 64);
+                Out.push_back(static_cast<std::uint8_t>(0x80 | (Count - 1)));
+                Out.insert(Out.end(), Delta + LiteralStart, Delta + LiteralStart + Count);
+                LiteralStart += Count;
+                LiteralCount -= Count;
+            }
+        };
+        std::uint32_t i = 0;
+        while (i < PAGE_SIZE) {
+            // Zero runs (unchanged bytes) are the common case.
+            std::uint32_t Zeros = 0;
+            while (i + Zeros < PAGE_SIZE && Delta[i + Zeros] == 0 && Zeros < 128) {
+                Zeros++;
+            }
+            if (Zeros >= 2 || (Zeros == 1 && i + 1 == PAGE_SIZE)) {
+                FlushLiterals();
+                Out.push_back(static_cast<std::uint8_t>(Zeros - 1));
+                i += Zeros;
+                continue;
+            }
+            // Back-references for repeated byte patterns (tables, fills).
+            std::uint32_t MatchLength = 0, MatchOffset = 0;
+            if (i + 3 <= PAGE_SIZE) {
+                std::uint8_t Hash = static_cast<std::uint8_t>(Delta[i] * 33 ^ Delta[i + 1] * 7 ^ Delta[i + 2]);
+                std::int16_t Candidate = Recent[Hash];
+                Recent[Hash] = static_cast<std::int16_t>(i);
+                if (Candidate >= 0) {
+                    while (i + MatchLength < PAGE_SIZE && MatchLength < 66 &&
+                           Delta[Candidate + MatchLength] == Delta[i + MatchLength]) {
+                        MatchLength++;
+                    }
+                    MatchOffset = i - Candidate;
+                }
+            }
+            if (MatchLength >= 3) {
+                FlushLiterals();
+                Out.push_back(static_cast<std::uint8_t>(0xC0 | (MatchLength - 3)));
+                Out.push_back(static_cast<std::uint8_t>(MatchOffset - 1));
+                i += MatchLength;
+                continue;
+            }
+            if (LiteralCount == 0) {
+                LiteralStart = i;
+            }
+            LiteralCount++;
+            i++;
+        }
+        FlushLiterals();
+    }
+
+    // Decodes one page produced by EncodePage into Delta.
+    static void DecodePage(const std::uint8_t* In, const std::uint8_t* End, std::uint8_t* Delta) {
+        std::uint32_t i = 0;
+        while (In < End) {
+            std::uint8_t Token = *In++;
+            if (Token < 0x80) {
+                std::memset(Delta + i, 0, Token + 1u);
+                i += Token + 1u;
+            } else if (Token < 0xC0) {
+                std::uint32_t Count = (Token & 0x3F) + 1u;
+                std::memcpy(Delta + i, In, Count);
+                In += Count;
+                i += Count;
+            } else {
+                std::uint32_t Count = (Token & 0x3F) + 3u;
+                std::uint32_t Offset = *In++ + 1u;
+                // Byte by byte: the source may overlap the bytes being written.
+                for (std::uint32_t j = 0; j < Count; j++, i++) {
+                    Delta[i] = Delta[i - Offset];
+                }
+            }
+        }
+        assert(i == PAGE_SIZE);
+    }
+};
+
+// This struct deduplicates parked snapshots on a background thread.
+// Park queues a freshly captured snapshot; the worker moves its pages into Pool. Before a
+// parked snapshot is restored or recaptured, Unpark takes it back, waiting if the worker is
+// deduplicating it at that moment.
+struct PageDeduplicator {
+    PagePool& Pool;
+    std::mutex Lock;
+    std::condition_variable Wake;
+    std::deque<CompressedSnapshot*> Pending;
+    // Snapshot the worker is deduplicating (nullptr when idle).
+    CompressedSnapshot* Busy = nullptr;
+    bool Stopping = false;
+    std::thread Worker;
+
+    explicit PageDeduplicator(PagePool& Target) : Pool(Target) {
+        Worker = std::thread([this]() { WorkerLoop(); });
+    }
+
+    // Deduplicates every queued snapshot, then joins the worker.
+    ~PageDeduplicator() {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            Stopping = true;
+        }
+        Wake.notify_all();
+        Worker.join();
+    }
+
+    void Park(CompressedSnapshot& Snapshot) {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            Pending.push_back(&Snapshot);
+        }
+        Wake.notify_all();
+    }
+
+    // Takes Snapshot back from the worker; afterwards it may be restored or recaptured.
+    void Unpark(CompressedSnapshot& Snapshot) {
+        std::unique_lock<std::mutex> Guard(Lock);
+        Pending.erase(std::remove(Pending.begin(), Pending.end(), &Snapshot), Pending.end());
+        Wake.wait(Guard, [&]() { return Busy != &Snapshot; });
+    }
+
+    // Waits until every parked snapshot has been deduplicated.
+    void Drain() {
+        std::unique_lock<std::mutex> Guard(Lock);
+        Wake.wait(Guard, [this]() { return Pending.empty() && Busy == nullptr; });
+    }
+
+    void WorkerLoop() {
+        std::unique_lock<std::mutex> Guard(Lock);
+        for (;;) {
+            Wake.wait(Guard, [this]() { return Stopping || !Pending.empty(); });
+            if (Pending.empty()) {
+                return;
+            }
+            CompressedSnapshot* Snapshot = Pending.front();
+            Pending.pop_front();
+            Busy = Snapshot;
+            Guard.unlock();
+            Snapshot->Deduplicate(Pool);
+            Guard.lock();
+            Busy = nullptr;
+            Wake.notify_all();
+        }
+    }
+};
+
+// constinit (C++20) guarantees constant initialisation; in C++17 a static object initialised from
+// a constant expression is constant-initialised anyway, the compiler just does not check it.
+#if defined(__cpp_constinit)
+    #define MACHINE_CONSTINIT constinit
+#else
+    #define MACHINE_CONSTINIT
+#endif
+
+// Builds a machine in its post-reset state with Rom placed at RomBase and PC at EntryPoint.
+// The ROM image is expected to contain its own vectors if it covers 0xFFFA..0xFFFF.
+// Use it to declare a MACHINE_CONSTINIT Machine whose memory is baked into the executable.
+template <std::size_t N>
+constexpr Machine MakeBootedMachine(const std::uint8_t (&Rom)[N], std::uint16_t RomBase, std::uint16_t EntryPoint = 0xFFFC) {
+    return Machine { CPU(EntryPoint), Mem(Rom, static_cast<std::uint32_t>(N), RomBase) };
+}
+
+// ROM images can be embedded at build time in two ways:
+//  - generate a header with "main --embed-rom rom.bin NAME > rom.h" and build with
+//    -DCPU_ROM_HEADER='"rom.h"' -DCPU_ROM_IMAGE=NAME -DCPU_ROM_BASE=0x8000 [-DCPU_ROM_ENTRY=...]
+//  - on compilers with #embed, build with -DCPU_ROM_FILE='"rom.bin"' -DCPU_ROM_BASE=0x8000
+#if defined(CPU_ROM_HEADER)
+    #include CPU_ROM_HEADER
+#elif defined(CPU_ROM_FILE) && defined(__has_embed)
+    inline constexpr std::uint8_t CPU_EMBEDDED_ROM[] = {
+        #embed CPU_ROM_FILE
+    };
+    #define CPU_ROM_IMAGE CPU_EMBEDDED_ROM
+#endif
+#if defined(CPU_ROM_IMAGE) && !defined(CPU_ROM_ENTRY)
+    #define CPU_ROM_ENTRY 0xFFFC
+#endif
+
+// The demo program: JSR $4242 at the reset address, LDA #$84 at $4242.
+inline constexpr std::uint8_t DEMO_RESET_CODE[] = { 0x20, 0x42, 0x42 };
+inline constexpr std::uint8_t DEMO_SUBROUTINE[] = { 0xA9, 0x84 };
+
+constexpr Machine MakeDemoMachine() {
+    Machine Demo = MakeBootedMachine(DEMO_RESET_CODE, 0xFFFC);
+    Demo.Memory.Data[0x4242] = DEMO_SUBROUTINE[0];
+    Demo.Memory.Data[0x4243] = DEMO_SUBROUTINE[1];
+    return Demo;
+}
+
+// The machine run by main, constant-initialised with its program already in memory.
+#if defined(CPU_ROM_IMAGE)
+MACHINE_CONSTINIT Machine BootMachine = MakeBootedMachine(CPU_ROM_IMAGE, CPU_ROM_BASE, CPU_ROM_ENTRY);
+#else
+MACHINE_CONSTINIT Machine BootMachine = MakeDemoMachine();
+#endif
+
+// Prints a C++ header embedding the file at Path as "inline constexpr std::uint8_t Name[]".
+int EmbedRom(const char* Path, const char* Name) {
+    std::FILE* File = std::fopen(Path, "rb");
+    if (File == nullptr) {
+        std::cerr << "Cannot open ROM " << Path << std::endl;
+        return 1;
+    }
+    std::printf("// Generated by main --embed-rom from %s\n#pragma once\n#include <cstdint>\n\n", Path);
+    std::printf("inline constexpr std::uint8_t %s[] = {", Name);
+    int Byte;
+    std::size_t Count = 0;
+    while ((Byte = std::fgetc(File)) != EOF) {
+        std::printf("%s0x%02X,", Count % 16 == 0 ? "\n    " : " ", Byte);
+        Count++;
+    }
+    std::printf("\n};\n");
+    std::fclose(File);
+    return 0;
+}
+
+
+// This struct describes one opcode implemented by CPU::Execute.
+struct OpcodeInfo {
+    std::uint8_t Opcode;
+    const char* Mnemonic;
+    const char* Mode;
+    std::uint8_t Bytes;         // Instruction length including the opcode
+    std::uint8_t Cycles;        // Base cycle count
+};
+
+// Table of every opcode CPU::Execute handles. Keep in sync with the switch in Execute.
+inline constexpr OpcodeInfo OPCODE_TABLE[] = {
+    { CPU::INS_LDA_IM,  "LDA", "Immediate",   2, 2 },
+    { CPU::INS_LDA_ZP,  "LDA", "Zero Page",   2, 3 },
+    { CPU::INS_LDA_ZPX, "LDA", "Zero Page,X", 2, 4 },
+    { CPU::INS_JSR,     "JSR", "Absolute",    3, 6 },
+    { CPU::INS_RTS,     "RTS", "Implied",     1, 6 },
+    { CPU::INS_RTI,     "RTI", "Implied",     1, 6 },
+    { CPU::INS_PHP,     "PHP", "Implied",     1, 3 },
+    { CPU::INS_PLP,     "PLP", "Implied",     1, 4 },
+};
+
+// Returns the table entry for Opcode, or nullptr if Execute does not implement it.
+inline const OpcodeInfo* FindOpcode(std::uint8_t Opcode) {
+    for (const OpcodeInfo& Info : OPCODE_TABLE) {
+        if (Info.Opcode == Opcode) {
+            return &Info;
+        }
+    }
+    return nullptr;
+}
+
+// Loads the file at Path into memory at Base; Loaded, if set, receives the number of bytes read.
+// @return false if the file could not be read.
+bool LoadImage(Mem& memory, const char* Path, std::uint32_t Base, std::size_t* Loaded = nullptr) {
+    std::FILE* File = std::fopen(Path, "rb");
+    if (File == nullptr) {
+        return false;
+    }
+    std::size_t Size = std::fread(&memory.Data[Base], 1, Mem::MAX_MEM - Base, File);
+    std::fclose(File);
+    if (Loaded != nullptr) {
+        *Loaded = Size;
+    }
+    return Size > 0;
+}
+
+// This struct is the statically recovered control-flow graph of a memory image, built by recursive
+// disassembly (driven by OPCODE_TABLE) from the reset address (0xFFFC, where Reset puts PC) and
+// the NMI/IRQ vectors that are set, inside the image and not part of the reset code. It holds basic blocks, subroutines (reset/interrupt entries and JSR targets)
+// with their call graph, and a per-address classification that flags code/data ambiguity.
+// This instruction set has no jumps or branches: the only control transfers are JSR (whose
+// callee is assumed to return to the next instruction) and RTS/RTI, whose targets come from the
+// stack and are not followed. Unknown opcodes end a path; they are reported in UnknownOpcodes.
+// Everything is sized by Mem::MAX_MEM and built in two linear passes, cheap enough for every load.
+struct ControlFlowGraph {
+    static constexpr std::uint32_t NONE = UINT32_MAX;
+
+    // Classification bits in AddressFlags.
+    static constexpr std::uint8_t
+        ADDRESS_CODE = 0b0001,          // First byte of a decoded instruction
+        ADDRESS_OPERAND = 0b0010,       // Operand byte of a decoded instruction
+        ADDRESS_DATA = 0b0100,          // Interrupt vector byte
+        ADDRESS_AMBIGUOUS = 0b1000;     // More than one of the above
+
+    // How a block ends.
+    enum class Exit : std::uint8_t {
+        FallThrough,            // Into the block at Next, which is also entered from elsewhere
+        Call,                   // JSR to Callee, returning to Next
+        Return,                 // RTS
+        ReturnFromInterrupt,    // RTI
+        Unknown,                // Unimplemented opcode
+    };
+
+    // This struct is one basic block: straight-line instructions entered only at Start.
+    struct Block {
+        std::uint16_t Start;
+        std::uint16_t Last;             // Address of the last instruction
+        std::uint32_t Bytes;
+        std::uint32_t Instructions;
+        Exit Kind;
+        std::uint32_t Next = NONE;      // Successor block in the same subroutine
+        std::uint32_t Callee = NONE;    // Subroutine index of a JSR target
+    };
+
+    // This struct is a subroutine: every block reachable from Entry without following calls.
+    struct Subroutine {
+        std::uint16_t Entry;
+        bool Handler;                   // Entered by reset or an interrupt rather than a JSR
+        std::vector<std::uint32_t> Blocks;
+        std::vector<std::uint32_t> Callees;
+        std::vector<std::uint32_t> Callers;
+    };
+
+    std::vector<Block> Blocks;                  // Sorted by Start
+    std::vector<Subroutine> Subroutines;
+    std::vector<std::uint32_t> BlockAt;         // Block index by start address, or NONE
+    std::vector<std::uint8_t> AddressFlags;
+    std::vector<std::uint16_t> Ambiguous;       // Addresses with ADDRESS_AMBIGUOUS, ascending
+    std::vector<bool> Opcodes;                  // Implemented opcodes that are reachable
+    std::vector<std::uint8_t> UnknownOpcodes;   // Reachable unimplemented opcodes, in discovery order
+
+    // Recovers the graph of memory, replacing any previous contents. The image occupies
+    // [ImageStart, ImageEnd); interrupt vectors pointing outside it are not followed.
+    void Build(const Mem& memory, std::uint32_t ImageStart = 0, std::uint32_t ImageEnd = Mem::MAX_MEM) {
+        Blocks.clear();
+        Subroutines.clear();
+        Ambiguous.clear();
+        UnknownOpcodes.clear();
+        BlockAt.assign(Mem::MAX_MEM, NONE);
+        AddressFlags.assign(Mem::MAX_MEM, 0);
+        Opcodes.assign(256, false);
+
+        // Pass 1: recursive disassembly. Leaders are entries, JSR targets, return points and
+        // addresses where a path runs into code decoded earlier.
+        std::vector<bool> Leader(Mem::MAX_MEM, false);
+        std::vector<std::uint8_t> Length(Mem::MAX_MEM, 0);
+        std::vector<std::uint16_t> Entries;
+        std::vector<std::uint16_t> Calls;
+        std::vector<std::uint16_t> Worklist;
+        auto AddEntry = [&](std::uint16_t Entry) {
+            Entries.push_back(Entry);
+            Leader[Entry] = true;
+            Worklist.push_back(Entry);
+        };
+        auto Disassemble = [&]() {
+            while (!Worklist.empty()) {
+                std::uint16_t Address = Worklist.back();
+                Worklist.pop_back();
+                while (true) {
+                    if (AddressFlags[Address] & ADDRESS_CODE) {
+                        Leader[Address] = true;
+                        break;
+                    }
+                    AddressFlags[Address] |= ADDRESS_CODE;
+                    std::uint8_t Opcode = memory[Address];
+                    const OpcodeInfo* Info = FindOpcode(Opcode);
+                    if (Info == nullptr) {
+                        if (std::find(UnknownOpcodes.begin(), UnknownOpcodes.end(), Opcode) == UnknownOpcodes.end()) {
+                            UnknownOpcodes.push_back(Opcode);
+                        }
+                        Length[Address] = 1;
+                        break;
+                    }
+                    Opcodes[Opcode] = true;
+                    Length[Address] = Info->Bytes;
+                    for (std::uint8_t Byte = 1; Byte < Info->Bytes; Byte++) {
+                        AddressFlags[static_cast<std::uint16_t>(Address + Byte)] |= ADDRESS_OPERAND;
+                    }
+                    std::uint16_t Next = static_cast<std::uint16_t>(Address + Info->Bytes);
+                    if (Opcode == CPU::INS_RTS || Opcode == CPU::INS_RTI) {
+                        break;
+                    }
+                    if (Opcode == CPU::INS_JSR) {
+                        std::uint16_t Target = static_cast<std::uint16_t>(memory[static_cast<std::uint16_t>(Address + 1)] |
+                                                                          (memory[static_cast<std::uint16_t>(Address + 2)] << 8));
+                        Calls.push_back(Target);
+                        Leader[Target] = true;
+                        Leader[Next] = true;
+                        Worklist.push_back(Target);
+                        Worklist.push_back(Next);
+                        break;
+                    }
+                    Address = Next;
+                }
+            }
+        };
+        // The reset code runs first: Reset puts PC on the reset vector itself, so its code may
+        // cover the IRQ vector (and, after a JSR, the NMI vector) bytes.
+        AddEntry(0xFFFC);
+        Disassemble();
+        // An interrupt vector is followed only if it is set, its bytes are not reset code and it
+        // points into the image; only followed vectors are classified as data.
+        for (std::uint16_t Vector : { CPU::NMI_VECTOR, CPU::IRQ_VECTOR }) {
+            std::uint16_t Target = static_cast<std::uint16_t>(memory[Vector] | (memory[Vector + 1] << 8));
+            bool Decoded = (AddressFlags[Vector] | AddressFlags[Vector + 1]) & (ADDRESS_CODE | ADDRESS_OPERAND);
+            if (Target == 0 || Decoded || Target < ImageStart || Target >= ImageEnd) {
+                continue;
+            }
+            AddressFlags[Vector] |= ADDRESS_DATA;
+            AddressFlags[Vector + 1] |= ADDRESS_DATA;
+            AddEntry(Target);
+            Disassemble();
+        }
+
+        // Pass 2: cut the decoded code into blocks at the leaders, in address order.
+        for (std::uint32_t Start = 0; Start < Mem::MAX_MEM; Start++) {
+            if (!Leader[Start] || !(AddressFlags[Start] & ADDRESS_CODE)) {
+                continue;
+            }
+            Block Entry{ static_cast<std::uint16_t>(Start), static_cast<std::uint16_t>(Start), 0, 0, Exit::FallThrough };
+            std::uint16_t Address = static_cast<std::uint16_t>(Start);
+            while (true) {
+                Entry.Last = Address;
+                Entry.Instructions++;
+                Entry.Bytes += Length[Address];
+                std::uint8_t Opcode = memory[Address];
+                std::uint16_t Next = static_cast<std::uint16_t>(Address + Length[Address]);
+                if (FindOpcode(Opcode) == nullptr) {
+                    Entry.Kind = Exit::Unknown;
+                    break;
+                }
+                if (Opcode == CPU::INS_RTS || Opcode == CPU::INS_RTI) {
+                    Entry.Kind = Opcode == CPU::INS_RTS ? Exit::Return : Exit::ReturnFromInterrupt;
+                    break;
+                }
+                if (Opcode == CPU::INS_JSR || Leader[Next] || Entry.Bytes >= Mem::MAX_MEM) {
+                    Entry.Kind = Opcode == CPU::INS_JSR ? Exit::Call : Exit::FallThrough;
+                    // Next holds the address until the block indices are known.
+                    Entry.Next = Next;
+                    break;
+                }
+                Address = Next;
+            }
+            BlockAt[Start] = static_cast<std::uint32_t>(Blocks.size());
+            Blocks.push_back(Entry);
+        }
+
+        // Subroutines: the entries first, then every distinct JSR target.
+        std::unordered_map<std::uint16_t, std::uint32_t> SubroutineAt;
+        auto AddSubroutine = [&](std::uint16_t Entry, bool Handler) {
+            if (SubroutineAt.emplace(Entry, static_cast<std::uint32_t>(Subroutines.size())).second) {
+                Subroutines.push_back({ Entry, Handler, {}, {}, {} });
+            }
+        };
+        for (std::uint16_t Entry : Entries) {
+            AddSubroutine(Entry, true);
+        }
+        for (std::uint16_t Target : Calls) {
+            AddSubroutine(Target, false);
+        }
+
+        // Resolve successor addresses into block and subroutine indices.
+        for (Block& Entry : Blocks) {
+            if (Entry.Kind == Exit::Call) {
+                std::uint16_t Target = static_cast<std::uint16_t>(memory[static_cast<std::uint16_t>(Entry.Last + 1)] |
+                                                                  (memory[static_cast<std::uint16_t>(Entry.Last + 2)] << 8));
+                Entry.Callee = SubroutineAt[Target];
+            }
+            if (Entry.Next != NONE) {
+                Entry.Next = BlockAt[Entry.Next];
+            }
+        }
+
+        // Blocks of each subroutine and the call graph.
+        std::vector<std::uint32_t> Seen(Blocks.size(), NONE);
+        for (std::uint32_t Index = 0; Index < Subroutines.size(); Index++) {
+            Subroutine& Routine = Subroutines[Index];
+            std::uint32_t Current = BlockAt[Routine.Entry];
+            while (Current != NONE && Seen[Current] != Index) {
+                Seen[Current] = Index;
+                Routine.Blocks.push_back(Current);
+                std::uint32_t Callee = Blocks[Current].Callee;
+                if (Callee != NONE && std::find(Routine.Callees.begin(), Routine.Callees.end(), Callee) == Routine.Callees.end()) {
+                    Routine.Callees.push_back(Callee);
+                    Subroutines[Callee].Callers.push_back(Index);
+                }
+                Current = Blocks[Current].Next;
+            }
+        }
+
+        // Code/data ambiguity: bytes decoded both as an opcode and an operand (overlapping
+        // instructions) or both as code and as an interrupt vector.
+        for (std::uint32_t Address = 0; Address < Mem::MAX_MEM; Address++) {
+            std::uint8_t Flags = AddressFlags[Address];
+            bool Code = Flags & ADDRESS_CODE;
+            bool Operand = Flags & ADDRESS_OPERAND;
+            bool Data = Flags & ADDRESS_DATA;
+            if ((Code && Operand) || (Data && (Code || Operand))) {
+                AddressFlags[Address] |= ADDRESS_AMBIGUOUS;
+                Ambiguous.push_back(static_cast<std::uint16_t>(Address));
+            }
+        }
+    }
+
+    // @return the index of the block containing Address, or NONE.
+    std::uint32_t FindBlock(std::uint16_t Address) const {
+        auto After = std::upper_bound(Blocks.begin(), Blocks.end(), Address, [](std::uint16_t Value, const Block& Entry) {
+            return Value < Entry.Start;
+        });
+        if (After == Blocks.begin()) {
+            return NONE;
+        }
+        const Block& Entry = *(After - 1);
+        return static_cast<std::uint32_t>(Address - Entry.Start) < Entry.Bytes ? static_cast<std::uint32_t>(After - 1 - Blocks.begin()) : NONE;
+    }
+};
+
+// Prints the control-flow graph of the ROM at Path (loaded at Base): main --cfg rom.bin base
+int PrintControlFlow(const char* Path, std::uint32_t Base) {
+    Mem memory(nullptr, 0, 0);
+    std::size_t Size = 0;
+    if (Base >= Mem::MAX_MEM || !LoadImage(memory, Path, Base, &Size)) {
+        std::cerr << "Cannot load ROM " << Path << std::endl;
+        return 1;
+    }
+    ControlFlowGraph Graph;
+    Graph.Build(memory, Base, static_cast<std::uint32_t>(Base + Size));
+    static constexpr const char* EXITS[] = { "fall-through", "call", "return", "return-from-interrupt", "unknown opcode" };
+    std::printf("%zu blocks, %zu subroutines\n", Graph.Blocks.size(), Graph.Subroutines.size());
+    for (const ControlFlowGraph::Subroutine& Routine : Graph.Subroutines) {
+        std::printf("sub_%04X%s\n", Routine.Entry, Routine.Handler ? " (reset/interrupt entry)" : "");
+        for (std::uint32_t Index : Routine.Blocks) {
+            const ControlFlowGraph::Block& Entry = Graph.Blocks[Index];
+            std::printf("  block %04X-%04X %u instructions, %s", Entry.Start, Entry.Last, Entry.Instructions,
+                        EXITS[static_cast<int>(Entry.Kind)]);
+            if (Entry.Callee != ControlFlowGraph::NONE) {
+                std::printf(" sub_%04X", Graph.Subroutines[Entry.Callee].Entry);
+            }
+            std::printf("\n");
+        }
+        for (std::uint32_t Caller : Routine.Callers) {
+            std::printf("  called from sub_%04X\n", Graph.Subroutines[Caller].Entry);
+        }
+    }
+    for (std::uint16_t Address : Graph.Ambiguous) {
+        std::printf("ambiguous %04X\n", Address);
+    }
+    for (std::uint8_t Opcode : Graph.UnknownOpcodes) {
+        std::printf("unknown opcode 0x%02X\n", Opcode);
+    }
+    return 0;
+}
+
+// Prints a header for a build of the emulator specialised to the ROM at Path (loaded at Base):
+// only the opcodes the ROM can reach (per its ControlFlowGraph) keep their handlers.
+int SpecializeForRom(const char* Path, std::uint32_t Base) {
+    Mem memory(nullptr, 0, 0);
+    std::size_t Size = 0;
+    if (Base >= Mem::MAX_MEM || !LoadImage(memory, Path, Base, &Size)) {
+        std::cerr << "Cannot load ROM " << Path << std::endl;
+        return 1;
+    }
+    ControlFlowGraph Graph;
+    Graph.Build(memory, Base, static_cast<std::uint32_t>(Base + Size));
+    std::printf("// Generated by main --specialize from %s\n#pragma once\n\n", Path);
+    for (std::uint8_t Opcode : Graph.UnknownOpcodes) {
+        std::printf("// Warning: unimplemented opcode 0x%02X is reachable\n", Opcode);
+    }
+    std::printf("#define CPU_SPECIALIZED_OPCODES");
+    const char* Separator = " ";
+    for (const OpcodeInfo& Info : OPCODE_TABLE) {
+        if (Graph.Opcodes[Info.Opcode]) {
+            std::printf("%s0x%02X", Separator, Info.Opcode);
+            Separator = ", ";
+        }
+    }
+    std::printf("\n");
+    return 0;
+}
+
+
+// This struct counts host branch mispredicts around a block of code using perf_event_open.
+// On systems without perf events (or without permission) Valid() is false.
+struct BranchMissCounter {
+    int Fd = -1;
+
+    BranchMissCounter() {
+#if defined(__linux__)
+        perf_event_attr Attr;
+        std::memset(&Attr, 0, sizeof(Attr));
+        Attr.type = PERF_TYPE_HARDWARE;
+        Attr.size = sizeof(Attr);
+        Attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        Attr.disabled = 1;
+        Attr.exclude_kernel = 1;
+        Attr.exclude_hv = 1;
+        Fd = static_cast<int>(syscall(SYS_perf_event_open, &Attr, 0, -1, -1, 0));
+#endif
+    }
+
+    ~BranchMissCounter() {
+#if defined(__linux__)
+        if (Fd >= 0) {
+            close(Fd);
+        }
+#endif
+    }
+
+    bool Valid() const { return Fd >= 0; }
+
+    void Start() {
+#if defined(__linux__)
+        if (Fd >= 0) {
+            ioctl(Fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(Fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    std::uint64_t Stop() {
+        std::uint64_t Count = 0;
+#if defined(__linux__)
+        if (Fd >= 0) {
+            ioctl(Fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(Fd, &Count, sizeof(Count)) != sizeof(Count)) {
+                Count = 0;
+            }
+        }
+#endif
+        return Count;
+    }
+};
+
+
+// Prepares CPU and memory so the next Execute runs a stream of a single opcode.
+// @return The number of instructions the stream contains.
+using OpcodeStreamSetup = std::function<std::uint32_t(CPU&, Mem&, std::mt19937&)>;
+
+// Builds the synthetic instruction stream for one opcode.
+// Operands are random so handlers see varied addresses and values (and so varied Z/N results).
+OpcodeStreamSetup MakeOpcodeStream(const OpcodeInfo& Info) {
+    // Code lives at 0x8000..0xDFFF so stack pushes starting at 0x0100 never reach it.
+    static constexpr std::uint16_t CODE_START = 0x8000;
+    static constexpr std::uint32_t CODE_SIZE = 0x6000;
+
+    switch (Info.Opcode) {
+        case CPU::INS_JSR:
+            // A chain of JSRs, each calling the next one.
+            return [](CPU& cpu, Mem& memory, std::mt19937&) {
+                std::uint32_t Count = CODE_SIZE / 3;
+                for (std::uint32_t i = 0; i < Count; i++) {
+                    std::uint16_t Address = CODE_START + i * 3;
+                    memory[Address] = CPU::INS_JSR;
+                    memory[Address + 1] = (Address + 3) & 0xFF;
+                    memory[Address + 2] = (Address + 3) >> 8;
+                }
+                cpu.PC = CODE_START;
+                cpu.SP = 0x0100;
+                return Count;
+            };
+        case CPU::INS_RTS:
+            // A stack of return addresses, each returning to the next RTS.
+            return [](CPU& cpu, Mem& memory, std::mt19937&) {
+                std::uint32_t Count = CODE_SIZE / 3;
+                cpu.SP = 0x0100;
+                for (std::uint32_t i = 0; i < Count; i++) {
+                    memory[CODE_START + i] = CPU::INS_RTS;
+                }
+                // Push in reverse so the first RTS returns to CODE_START + 1.
+                for (std::uint32_t i = Count; i > 0; i--) {
+                    std::uint16_t ReturnAddr = CODE_START + i - 1;
+                    memory[cpu.SP] = ReturnAddr & 0xFF;
+                    memory[cpu.SP + 1] = ReturnAddr >> 8;
+                    cpu.SP += 2;
+                }
+                cpu.PC = CODE_START;
+                return Count;
+            };
+        case CPU::INS_RTI:
+            // A stack of interrupt frames (PC, status), each returning to the next RTI.
+            return [](CPU& cpu, Mem& memory, std::mt19937& Random) {
+                std::uint32_t Count = CODE_SIZE / 3;
+                cpu.SP = 0x0100;
+                for (std::uint32_t i = 0; i < Count; i++) {
+                    memory[CODE_START + i] = CPU::INS_RTI;
+                }
+                for (std::uint32_t i = Count; i > 0; i--) {
+                    std::uint16_t ReturnAddr = CODE_START + i;
+                    memory[cpu.SP] = ReturnAddr & 0xFF;
+                    memory[cpu.SP + 1] = ReturnAddr >> 8;
+                    memory[cpu.SP + 2] = static_cast<std::uint8_t>(Random());
+                    cpu.SP += 3;
+                }
+                cpu.PC = CODE_START;
+                return Count;
+            };
+        case CPU::INS_PHP:
+            // Straight-line PHPs pushing upwards from 0x0100.
+            return [](CPU& cpu, Mem& memory, std::mt19937&) {
+                std::uint32_t Count = CODE_SIZE;
+                for (std::uint32_t i = 0; i < Count; i++) {
+                    memory[CODE_START + i] = CPU::INS_PHP;
+                }
+                cpu.SP = 0x0100;
+                cpu.PC = CODE_START;
+                return Count;
+            };
+        case CPU::INS_PLP:
+            // Straight-line PLPs pulling a stack of random status bytes.
+            return [](CPU& cpu, Mem& memory, std::mt19937& Random) {
+                std::uint32_t Count = CODE_SIZE;
+                for (std::uint32_t i = 0; i < Count; i++) {
+                    memory[CODE_START + i] = CPU::INS_PLP;
+                    memory[0x0100 + i] = static_cast<std::uint8_t>(Random());
+                }
+                cpu.SP = static_cast<std::uint16_t>(0x0100 + Count);
+                cpu.PC = CODE_START;
+                return Count;
+            };
+        default: {
+            // Straight-line stream of the opcode with random operand bytes.
+            std::uint8_t Opcode = Info.Opcode;
+            std::uint8_t Bytes = Info.Bytes;
+            return [Opcode, Bytes](CPU& cpu, Mem& memory, std::mt19937& Random) {
+                std::uint32_t Count = CODE_SIZE / Bytes;
+                for (std::uint32_t i = 0; i < Count; i++) {
+                    std::uint16_t Address = CODE_START + i * Bytes;
+                    memory[Address] = Opcode;
+                    for (std::uint8_t b = 1; b < Bytes; b++) {
+                        memory[Address + b] = static_cast<std::uint8_t>(Random());
+                    }
+                }
+                cpu.X = static_cast<std::uint8_t>(Random());
+                cpu.PC = CODE_START;
+                return Count;
+            };
+        }
+    }
+}
+
+// Runs every opcode handler in isolation and prints host ns/op and branch-mispredicts/op.
+// There is a single engine (the interpreter in CPU::Execute), so one row per opcode.
+int BenchOpcodes(std::uint32_t Iterations) {
+    Mem mem;
+    CPU cpu;
+    std::mt19937 Random(6502);
+    BranchMissCounter BranchMisses;
+
+    std::printf("%-6s %-4s %-12s %10s %14s\n", "engine", "op", "mode", "ns/op", "mispredict/op");
+    for (const OpcodeInfo& Info : OPCODE_TABLE) {
+        if (!CPU::OpcodeEnabled(Info.Opcode)) {
+            continue;
+        }
+        OpcodeStreamSetup Setup = MakeOpcodeStream(Info);
+        double Nanoseconds = 0;
+        std::uint64_t Misses = 0;
+        std::uint64_t Instructions = 0;
+        for (std::uint32_t i = 0; i < Iterations; i++) {
+            cpu.Reset(mem);
+            std::uint32_t Count = Setup(cpu, mem, Random);
+            auto Start = std::chrono::steady_clock::now();
+            BranchMisses.Start();
+            cpu.Execute(Count * Info.Cycles, mem);
+            Misses += BranchMisses.Stop();
+            auto End = std::chrono::steady_clock::now();
+            Nanoseconds += std::chrono::duration<double, std::nano>(End - Start).count();
+            Instructions += Count;
+        }
+        std::printf("%-6s %-4s %-12s %10.2f ", "interp", Info.Mnemonic, Info.Mode, Nanoseconds / Instructions);
+        if (BranchMisses.Valid()) {
+            std::printf("%14.4f\n", static_cast<double>(Misses) / Instructions);
+        } else {
+            std::printf("%14s\n", "n/a");
+        }
+    }
+    return 0;
+}
+
+
+// Returns the resident set size of this process in bytes (0 where unsupported).
+std::uint64_t ResidentBytes() {
+#if defined(__linux__)
+    std::FILE* File = std::fopen("/proc/self/statm", "r");
+    if (File == nullptr) {
+        return 0;
+    }
+    unsigned long long Size = 0, Resident = 0;
+    int Fields = std::fscanf(File, "%llu %llu", &Size, &Resident);
+    std::fclose(File);
+    if (Fields != 2) {
+        return 0;
+    }
+    return Resident * static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+#else
+    return 0;
+#endif
+}
+
+// Times Operation over Iterations runs and returns the mean latency in nanoseconds.
+double MeanNanoseconds(std::uint32_t Iterations, const std::function<void(std::uint32_t)>& Operation) {
+    auto Start = std::chrono::steady_clock::now();
+    for (std::uint32_t i = 0; i < Iterations; i++) {
+        Operation(i);
+    }
+    auto End = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(End - Start).count() / Iterations;
+}
+
+// Measures how densely machines can be packed: bytes per idle machine, fork (copy) latency,
+// snapshot-restore latency, CPU::Reset latency and how many machines fit in BudgetMiB.
+// The flat 64 KiB array is the only memory backend in this tree, so it is the only row.
+int BenchDensity(std::uint64_t BudgetMiB) {
+    static constexpr std::uint32_t MACHINES = 256;
+    static constexpr std::uint32_t ITERATIONS = 2000;
+
+    // Boot a template machine with the demo program.
+    Machine Booted = MakeDemoMachine();
+
+    // Memory per idle machine, measured as the RSS growth for MACHINES booted machines.
+    std::uint64_t ResidentBefore = ResidentBytes();
+    std::vector<Machine> Fleet(MACHINES, Booted);
+    std::uint64_t ResidentAfter = ResidentBytes();
+    double BytesPerMachine = ResidentAfter > ResidentBefore
+        ? static_cast<double>(ResidentAfter - ResidentBefore) / MACHINES
+        : static_cast<double>(sizeof(Machine));
+
+    // Fork: copy-construct a new machine from the booted one.
+    double ForkNs = MeanNanoseconds(ITERATIONS, [&](std::uint32_t i) {
+        Machine Forked(Booted);
+        Fleet[i % MACHINES].Cpu.A ^= Forked.Memory[i & 0xFFFF];
+    });
+    // Snapshot restore: overwrite an existing machine with the saved state.
+    double RestoreNs = MeanNanoseconds(ITERATIONS, [&](std::uint32_t i) {
+        Fleet[i % MACHINES] = Booted;
+    });
+    // CPU::Reset, which also clears memory.
+    double ResetNs = MeanNanoseconds(ITERATIONS, [&](std::uint32_t i) {
+        Fleet[i % MACHINES].Reset();
+    });
+
+    std::uint64_t MaxMachines = static_cast<std::uint64_t>((BudgetMiB * 1024.0 * 1024.0) / BytesPerMachine);
+
+    // Parked machines: run each fleet member a little so it diverges from the base image,
+    // then store it as a compressed snapshot against the booted machine.
+    // The pool of shared pages (used below) must outlive the snapshots.
+    PagePool Pool;
+    std::vector<CompressedSnapshot> Parked(MACHINES);
+    for (std::uint32_t i = 0; i < MACHINES; i++) {
+        Fleet[i] = Booted;
+        Fleet[i].Memory.Data[0x0200 + i] = static_cast<std::uint8_t>(i);
+        Fleet[i].Cpu.Execute(8, Fleet[i].Memory);
+        Parked[i].Capture(Fleet[i], Booted.Memory);
+    }
+    double ParkedBytes = 0;
+    for (const CompressedSnapshot& Snapshot : Parked) {
+        ParkedBytes += static_cast<double>(Snapshot.Bytes()) / MACHINES;
+    }
+    double ParkNs = MeanNanoseconds(ITERATIONS, [&](std::uint32_t i) {
+        Parked[i % MACHINES].Capture(Fleet[i % MACHINES], Booted.Memory);
+    });
+    double UnparkNs = MeanNanoseconds(ITERATIONS, [&](std::uint32_t i) {
+        Parked[i % MACHINES].Restore(Fleet[i % MACHINES], Booted.Memory);
+    });
+    std::uint64_t MaxParked = static_cast<std::uint64_t>((BudgetMiB * 1024.0 * 1024.0) / ParkedBytes);
+
+    // Deduplicated parked machines: the same snapshots after the background deduplicator has
+    // shared their identical pages through a pool. Pool overhead is charged to the machines.
+    PageDeduplicator Deduplicator(Pool);
+    for (CompressedSnapshot& Snapshot : Parked) {
+        Deduplicator.Park(Snapshot);
+    }
+    Deduplicator.Drain();
+    double DedupBytes = static_cast<double>(Pool.UniqueBytes()) / MACHINES;
+    for (const CompressedSnapshot& Snapshot : Parked) {
+        DedupBytes += static_cast<double>(Snapshot.Bytes()) / MACHINES;
+    }
+    double DedupRestoreNs = MeanNanoseconds(ITERATIONS, [&](std::uint32_t i) {
+        Deduplicator.Unpark(Parked[i % MACHINES]);
+        Parked[i % MACHINES].Restore(Fleet[i % MACHINES], Booted.Memory);
+    });
+    std::uint64_t MaxDedup = static_cast<std::uint64_t>((BudgetMiB * 1024.0 * 1024.0) / DedupBytes);
+
+    std::printf("%-8s %10s %10s %10s %10s %14s\n", "backend", "bytes/idle", "fork ns", "restore ns", "reset ns", "machines");
+    std::printf("%-8s %10.0f %10.0f %10.0f %10.0f %14llu  (%llu MiB budget, sizeof(Machine) = %zu)\n",
+                "flat", BytesPerMachine, ForkNs, RestoreNs, ResetNs,
+                static_cast<unsigned long long>(MaxMachines), static_cast<unsigned long long>(BudgetMiB), sizeof(Machine));
+    // For parked machines the "fork" column is the time to park (capture) one.
+    std::printf("%-8s %10.0f %10.0f %10.0f %10s %14llu\n",
+                "parked", ParkedBytes, ParkNs, UnparkNs, "-", static_cast<unsigned long long>(MaxParked));
+    std::printf("%-8s %10.0f %10s %10.0f %10s %14llu\n",
+                "dedup", DedupBytes, "-", DedupRestoreNs, "-", static_cast<unsigned long long>(MaxDedup));
+    return 0;
+}
+
+
+// Measures host wall-clock latency from another thread asserting IRQ or NMI to the first
+// instruction of the 6502 handler having executed, and prints p50/p99/p99.9.
+// The CPU runs long budgets with ReturnAfterInterrupt set, so Execute returns right after
+// the handler's first instruction and the latency is observed on return.
+int BenchInterruptLatency(std::uint32_t Samples) {
+    static constexpr std::uint32_t BUDGET = 1000000;
+
+    Machine machine;
+    machine.Reset();
+    // Every byte is LDA #$A9, so the main program and both handlers (at $A9A9) are endless LDA streams.
+    std::fill(std::begin(machine.Memory.Data), std::end(machine.Memory.Data), CPU::INS_LDA_IM);
+    machine.Cpu.ReturnAfterInterrupt = true;
+
+    std::printf("%-6s %-4s %10s %10s %10s %10s\n", "engine", "line", "p50 us", "p99 us", "p99.9 us", "max us");
+    for (std::uint32_t Line : { CPU::INTERRUPT_IRQ, CPU::INTERRUPT_NMI }) {
+        std::vector<double> Latencies;
+        Latencies.reserve(Samples);
+        for (std::uint32_t Sample = 0; Sample < Samples; Sample++) {
+            // Undo the previous interrupt frame (the stack overwrote three program bytes)
+            // and re-enable IRQs, as an RTI would.
+            machine.Cpu.SP = 0x0100;
+            std::fill(&machine.Memory.Data[0x0100], &machine.Memory.Data[0x0103], CPU::INS_LDA_IM);
+            machine.Cpu.SetFlag(CPU::FLAG_I, false);
+            std::atomic<std::int64_t> AssertedAt { 0 };
+            std::thread Device([&]() {
+                // Assert at a random point while Execute is busy.
+                std::this_thread::sleep_for(std::chrono::microseconds(20 + Sample % 50));
+                AssertedAt.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_release);
+                if (Line == CPU::INTERRUPT_NMI) {
+                    machine.Cpu.AssertNMI();
+                } else {
+                    machine.Cpu.AssertIRQ();
+                }
+            });
+            // Run until the handler has been entered (I is set by the interrupt sequence).
+            do {
+                machine.Cpu.Execute(BUDGET, machine.Memory);
+            } while (!machine.Cpu.Flag(CPU::FLAG_I));
+            std::int64_t Now = std::chrono::steady_clock::now().time_since_epoch().count();
+            Device.join();
+            std::chrono::steady_clock::duration Elapsed(Now - AssertedAt.load(std::memory_order_acquire));
+            Latencies.push_back(std::chrono::duration<double, std::micro>(Elapsed).count());
+        }
+        std::sort(Latencies.begin(), Latencies.end());
+        auto Percentile = [&](double P) {
+            return Latencies[std::min<std::size_t>(Latencies.size() - 1, static_cast<std::size_t>(P * Latencies.size()))];
+        };
+        std::printf("%-6s %-4s %10.2f %10.2f %10.2f %10.2f\n", "interp", Line == CPU::INTERRUPT_NMI ? "NMI" : "IRQ",
+                    Percentile(0.50), Percentile(0.99), Percentile(0.999), Latencies.back());
+    }
+    return 0;
+}
+
+// This struct is a threaded test device: every Period cycles it raises a write of its tick
+// count to Address, stamped Lookahead cycles after the tick.
+struct TimerDevice {
+    std::uint16_t Address;
+    std::uint32_t Period, Lookahead;
+    std::uint64_t Ticks = 0;
+    DeviceLink* Link = nullptr;
+
+    void Attach(DeviceLink& Target) {
+        Link = &Target;
+    }
+
+    void Write(std::uint64_t, std::uint16_t, std::uint8_t) {}
+
+    void Sync(std::uint64_t Cycle) {
+        while ((Ticks + 1) * Period <= Cycle) {
+            Ticks++;
+            Link->Raise({ Ticks * Period + Lookahead, Address, static_cast<std::uint8_t>(Ticks), InputEvent::WRITE_BYTE });
+        }
+    }
+};
+
+// Runs a machine Runs times alongside two threaded timers with very different lookaheads and
+// checks that every run delivers the same events at the same cycles, each at the first
+// instruction boundary at or after its stamp. Returns 0 when all runs agree, 1 otherwise.
+int CheckDevices(std::uint32_t Runs) {
+    static constexpr std::uint64_t CYCLES = 20000;
+    // At most one instruction (or interrupt sequence) passes between a stamp and its delivery.
+    static constexpr std::uint64_t MAX_DELAY = 8;
+    // Address, period and lookahead of each timer.
+    static constexpr std::uint32_t TIMERS[2][3] = { { 0x0200, 1000, 300 }, { 0x0201, 1500, 7000 } };
+
+    std::vector<InputEvent> First;
+    std::uint64_t FirstHash = 0;
+    for (std::uint32_t Run = 0; Run < Runs; Run++) {
+        auto machine = std::make_unique<Machine>();
+        machine->Reset();
+        // An endless LDA #$A9 stream from $A9A9, which stays clear of the timers' addresses.
+        std::fill(std::begin(machine->Memory.Data), std::end(machine->Memory.Data), CPU::INS_LDA_IM);
+        auto Port = std::make_unique<InputPort>();
+        std::vector<InputEvent> Delivered;
+        Port->Record = &Delivered;
+        machine->Cpu.Input = Port.get();
+        {
+            TimerDevice Fast { TIMERS[0][0], TIMERS[0][1], TIMERS[0][2] };
+            TimerDevice Slow { TIMERS[1][0], TIMERS[1][1], TIMERS[1][2] };
+            DeviceThread<TimerDevice> FastThread(Fast, Fast.Address, 0xFFFF, Fast.Lookahead);
+            DeviceThread<TimerDevice> SlowThread(Slow, Slow.Address, 0xFFFF, Slow.Lookahead);
+            DeviceBus Bus;
+            Bus.Links = { &FastThread.Link, &SlowThread.Link };
+            RunWithDevices(*machine, Bus, CYCLES);
+        }
+        std::uint64_t Hash = HashBytes(machine->Memory.Data, Mem::MAX_MEM);
+        for (const InputEvent& Event : Delivered) {
+            const std::uint32_t* Timer = TIMERS[Event.Address - TIMERS[0][0]];
+            std::uint64_t Stamp = Event.Value * std::uint64_t(Timer[1]) + Timer[2];
+            if (Event.Cycle < Stamp || Event.Cycle - Stamp >= MAX_DELAY) {
+                std::printf("Run %u: event stamped %llu for $%04X delivered at %llu\n", Run,
+                            static_cast<unsigned long long>(Stamp), Event.Address, static_cast<unsigned long long>(Event.Cycle));
+                return 1;
+            }
+        }
+        if (Run == 0) {
+            First = Delivered;
+            FirstHash = Hash;
+        } else if (Hash != FirstHash || Delivered.size() != First.size() ||
+                   !std::equal(Delivered.begin(), Delivered.end(), First.begin(), [](const InputEvent& A, const InputEvent& B) {
+                       return A.Cycle == B.Cycle && A.Address == B.Address && A.Value == B.Value;
+                   })) {
+            std::printf("Run %u differs from run 0\n", Run);
+            return 1;
+        }
+    }
+    std::printf("%u runs with %zu device events each: identical and on time\n", Runs, First.size());
+    return 0;
+}
+
+
+// *** BATCH RUNNER ***
+
+// Version of the emulation core. Part of every result-cache key: bump it whenever a change
+// can alter the outcome of a run, so stale cached results are never reused.
+inline constexpr std::uint32_t EMULATOR_VERSION = 7;
+
+// Why a run ended.
+enum class StopReason : std::uint8_t {
+    BudgetExhausted,            // The cycle budget was used up
+    Stopped,                    // MachineRun::Stop was called
+    Crashed,                    // The worker process running it kept crashing
+};
+
+// This struct holds the outcome of one batch run.
+struct RunResult {
+    std::uint16_t PC = 0, SP = 0;
+    std::uint8_t A = 0, X = 0, Y = 0, Status = 0;
+    std::uint64_t Cycles = 0;
+    std::uint64_t MemoryHash = 0;
+    StopReason Reason = StopReason::BudgetExhausted;
+    // True when the result came from the result cache instead of running the machine.
+    bool Cached = false;
+    // Final contents of a selected memory range (--capture), for checking a ROM's results.
+    static constexpr std::uint32_t CAPTURE_BYTES = 16;
+    std::uint16_t CaptureAddress = 0;
+    std::uint8_t Capture[CAPTURE_BYTES] = {};
+};
+
+// Summarises the current state of machine, capturing RunResult::CAPTURE_BYTES from CaptureAddress.
+RunResult SummariseMachine(const Machine& machine, std::uint16_t CaptureAddress = 0) {
+    RunResult Result;
+    Result.PC = machine.Cpu.PC;
+    Result.SP = machine.Cpu.SP;
+    Result.A = machine.Cpu.A;
+    Result.X = machine.Cpu.X;
+    Result.Y = machine.Cpu.Y;
+    Result.Status = machine.Cpu.GetStatus();
+    Result.Cycles = machine.Cpu.TotalCycles;
+    Result.MemoryHash = HashBytes(machine.Memory.Data, Mem::MAX_MEM);
+    Result.CaptureAddress = CaptureAddress;
+    for (std::uint32_t i = 0; i < RunResult::CAPTURE_BYTES; i++) {
+        Result.Capture[i] = machine.Memory.Data[(CaptureAddress + i) % Mem::MAX_MEM];
+    }
+    return Result;
+}
+
+// Runs machine for Cycles cycles and summarises its final state.
+RunResult RunMachine(Machine& machine, std::uint32_t Cycles, std::uint16_t CaptureAddress = 0) {
+    machine.Cpu.Execute(Cycles, machine.Memory);
+    return SummariseMachine(machine, CaptureAddress);
+}
+
+// Returns the cache key of a deterministic run: a hash of the initial memory image, the initial
+// registers, the cycle budget, the captured address and EMULATOR_VERSION.
+std::uint64_t RunKey(const Machine& machine, std::uint32_t Cycles, std::uint16_t CaptureAddress = 0) {
+    const CPU& Cpu = machine.Cpu;
+    std::uint8_t State[] = {
+        static_cast<std::uint8_t>(Cpu.PC), static_cast<std::uint8_t>(Cpu.PC >> 8),
+        static_cast<std::uint8_t>(Cpu.SP), static_cast<std::uint8_t>(Cpu.SP >> 8),
+        Cpu.A, Cpu.X, Cpu.Y, Cpu.GetStatus(),
+        static_cast<std::uint8_t>(Cycles), static_cast<std::uint8_t>(Cycles >> 8),
+        static_cast<std::uint8_t>(Cycles >> 16), static_cast<std::uint8_t>(Cycles >> 24),
+        static_cast<std::uint8_t>(EMULATOR_VERSION), static_cast<std::uint8_t>(EMULATOR_VERSION >> 8),
+        static_cast<std::uint8_t>(EMULATOR_VERSION >> 16), static_cast<std::uint8_t>(EMULATOR_VERSION >> 24),
+        static_cast<std::uint8_t>(CaptureAddress), static_cast<std::uint8_t>(CaptureAddress >> 8),
+    };
+    std::uint64_t Hash = HashBytes(machine.Memory.Data, Mem::MAX_MEM);
+    return HashBytes(State, sizeof(State), Hash);
+}
+
+// This struct is an on-disk cache of run results, one small text file per key.
+struct ResultCache {
+    std::filesystem::path Directory;
+
+    std::filesystem::path PathFor(std::uint64_t Key) const {
+        char Name[32];
+        std::snprintf(Name, sizeof(Name), "%016llx.result", static_cast<unsigned long long>(Key));
+        return Directory / Name;
+    }
+
+    // Looks up Key. @return false on a miss (or an unreadable entry).
+    bool Load(std::uint64_t Key, RunResult& Result) const {
+        std::FILE* File = std::fopen(PathFor(Key).c_str(), "r");
+        if (File == nullptr) {
+            return false;
+        }
+        unsigned PC, SP, A, X, Y, Status, CaptureAddress;
+        unsigned long long Cycles, MemoryHash;
+        int Fields = std::fscanf(File, "%x %x %x %x %x %x %llu %llx %x", &PC, &SP, &A, &X, &Y, &Status, &Cycles, &MemoryHash, &CaptureAddress);
+        for (std::uint32_t i = 0; Fields == 9 && i < RunResult::CAPTURE_BYTES; i++) {
+            unsigned Byte;
+            if (std::fscanf(File, "%2x", &Byte) != 1) {
+                Fields = 0;
+            }
+            Result.Capture[i] = static_cast<std::uint8_t>(Byte);
+        }
+        std::fclose(File);
+        if (Fields != 9) {
+            return false;
+        }
+        Result.CaptureAddress = static_cast<std::uint16_t>(CaptureAddress);
+        Result.PC = static_cast<std::uint16_t>(PC);
+        Result.SP = static_cast<std::uint16_t>(SP);
+        Result.A = static_cast<std::uint8_t>(A);
+        Result.X = static_cast<std::uint8_t>(X);
+        Result.Y = static_cast<std::uint8_t>(Y);
+        Result.Status = static_cast<std::uint8_t>(Status);
+        Result.Cycles = Cycles;
+        Result.MemoryHash = MemoryHash;
+        Result.Cached = true;
+        return true;
+    }
+
+    // Stores Result under Key. Written to a temporary file and renamed, so concurrent
+    // runners never see a partial entry.
+    void Store(std::uint64_t Key, const RunResult& Result) const {
+        std::error_code Error;
+        std::filesystem::create_directories(Directory, Error);
+        std::filesystem::path Final = PathFor(Key);
+        std::filesystem::path Temporary = Final;
+        Temporary += ".tmp" + std::to_string(std::random_device{}());
+        std::FILE* File = std::fopen(Temporary.c_str(), "w");
+        if (File == nullptr) {
+            return;
+        }
+        std::fprintf(File, "%04X %04X %02X %02X %02X %02X %llu %016llx %04X ", Result.PC, Result.SP, Result.A, Result.X, Result.Y,
+                     Result.Status, static_cast<unsigned long long>(Result.Cycles), static_cast<unsigned long long>(Result.MemoryHash),
+                     Result.CaptureAddress);
+        for (std::uint8_t Byte : Result.Capture) {
+            std::fprintf(File, "%02X", Byte);
+        }
+        std::fprintf(File, "\n");
+        std::fclose(File);
+        std::filesystem::rename(Temporary, Final, Error);
+    }
+};
+
+// This struct records periodic checkpoints of a run together with the set of addresses the run
+// had touched (read, written or executed) by each checkpoint. When the image is edited, a later
+// run can resume from the last checkpoint that never touched an edited byte: everything up to it
+// would have happened identically, so only the edited bytes need patching in.
+struct CheckpointLog {
+    static constexpr char MAGIC[8] = { '6', '5', '0', '2', 'C', 'K', 'P', 'T' };
+
+    // This struct is the machine state at one checkpoint.
+    struct Checkpoint {
+        Machine State;
+        // Bit i set if address i was touched between the start of the run and this checkpoint.
+        std::vector<std::uint8_t> Touched = std::vector<std::uint8_t>(Mem::MAX_MEM / 8);
+
+        bool WasTouched(std::uint32_t Address) const {
+            return (Touched[Address / 8] >> (Address % 8)) & 1;
+        }
+    };
+
+    // Memory at the start of the run (the loaded image).
+    std::vector<std::uint8_t> InitialMemory;
+    // Registers at the start of the run.
+    CPU InitialCpu;
+    std::vector<Checkpoint> Checkpoints;
+    // Length of the run and the checkpoint interval, which fix the Execute budgets of every segment.
+    std::uint64_t Cycles = 0;
+    std::uint32_t Interval = 0;
+    // Input delivered during the run, stamped with the cycle of delivery.
+    std::vector<InputEvent> Inputs;
+
+    // Reads a log written by Save. @return false if missing, corrupt or from another core version.
+    bool Load(const std::filesystem::path& Path) {
+        std::FILE* File = std::fopen(Path.c_str(), "rb");
+        if (File == nullptr) {
+            return false;
+        }
+        char Magic[sizeof(MAGIC)];
+        std::uint32_t Version = 0, Count = 0;
+        bool Ok = std::fread(Magic, sizeof(Magic), 1, File) == 1 && std::memcmp(Magic, MAGIC, sizeof(MAGIC)) == 0 &&
+                  std::fread(&Version, sizeof(Version), 1, File) == 1 && Version == EMULATOR_VERSION &&
+                  std::fread(&Count, sizeof(Count), 1, File) == 1 &&
+                  std::fread(&Cycles, sizeof(Cycles), 1, File) == 1 &&
+                  std::fread(&Interval, sizeof(Interval), 1, File) == 1 &&
+                  std::fread(&InitialCpu, sizeof(InitialCpu), 1, File) == 1;
+        InitialMemory.resize(Mem::MAX_MEM);
+        Ok = Ok && std::fread(InitialMemory.data(), Mem::MAX_MEM, 1, File) == 1;
+        Checkpoints.clear();
+        for (std::uint32_t i = 0; Ok && i < Count; i++) {
+            Checkpoints.emplace_back();
+            Checkpoint& Entry = Checkpoints.back();
+            Ok = std::fread(&Entry.State, sizeof(Entry.State), 1, File) == 1 &&
+                 std::fread(Entry.Touched.data(), Entry.Touched.size(), 1, File) == 1;
+            // The instrumentation pointers are meaningless in another process.
+            Entry.State.Cpu.DetachHooks();
+        }
+        std::uint32_t InputCount = 0;
+        Ok = Ok && std::fread(&InputCount, sizeof(InputCount), 1, File) == 1;
+        Inputs.resize(Ok ? InputCount : 0);
+        Ok = Ok && (InputCount == 0 || std::fread(Inputs.data(), sizeof(InputEvent), InputCount, File) == InputCount);
+        std::fclose(File);
+        InitialCpu.DetachHooks();
+        return Ok;
+    }
+
+    // Writes the log, via a temporary file so a crash never leaves a truncated log behind.
+    void Save(const std::filesystem::path& Path) const {
+        std::error_code Error;
+        std::filesystem::create_directories(Path.parent_path(), Error);
+        std::filesystem::path Temporary = Path;
+        Temporary += ".tmp" + std::to_string(std::random_device{}());
+        std::FILE* File = std::fopen(Temporary.c_str(), "wb");
+        if (File == nullptr) {
+            return;
+        }
+        std::uint32_t Version = EMULATOR_VERSION;
+        std::uint32_t Count = static_cast<std::uint32_t>(Checkpoints.size());
+        std::fwrite(MAGIC, sizeof(MAGIC), 1, File);
+        std::fwrite(&Version, sizeof(Version), 1, File);
+        std::fwrite(&Count, sizeof(Count), 1, File);
+        std::fwrite(&Cycles, sizeof(Cycles), 1, File);
+        std::fwrite(&Interval, sizeof(Interval), 1, File);
+        std::fwrite(&InitialCpu, sizeof(InitialCpu), 1, File);
+        std::fwrite(InitialMemory.data(), Mem::MAX_MEM, 1, File);
+        for (const Checkpoint& Entry : Checkpoints) {
+            std::fwrite(&Entry.State, sizeof(Entry.State), 1, File);
+            std::fwrite(Entry.Touched.data(), Entry.Touched.size(), 1, File);
+        }
+        std::uint32_t InputCount = static_cast<std::uint32_t>(Inputs.size());
+        std::fwrite(&InputCount, sizeof(InputCount), 1, File);
+        std::fwrite(Inputs.data(), sizeof(InputEvent), InputCount, File);
+        std::fclose(File);
+        std::filesystem::rename(Temporary, Path, Error);
+    }
+};
+
+// Runs machine for Cycles cycles, checkpointing every Interval cycles into the log at LogPath.
+// If the log holds a previous run of an edited version of the same image, execution resumes from
+// the latest checkpoint whose touched set excludes every edited address, with the edits patched in.
+RunResult RunIncremental(Machine& machine, std::uint32_t Cycles, std::uint32_t Interval, const std::filesystem::path& LogPath,
+                         std::uint16_t CaptureAddress = 0) {
+    CheckpointLog Previous;
+    CheckpointLog Log;
+    Log.InitialMemory.assign(machine.Memory.Data, machine.Memory.Data + Mem::MAX_MEM);
+    Log.InitialCpu = machine.Cpu;
+    Log.InitialCpu.DetachHooks();
+    Log.Cycles = Cycles;
+    Log.Interval = Interval;
+
+    // Addresses whose initial contents changed since the previous run.
+    std::vector<std::uint32_t> Edited;
+    // A run fed live input is never resumed: the previous run may have had different input.
+    // Nor is one with a different checkpoint interval: the log's checkpoints must all sit on the
+    // grid of the Interval it records, or ReplaySegment could not reproduce them.
+    bool Resumable = machine.Cpu.Input == nullptr && Previous.Load(LogPath) && Previous.Interval == Interval &&
+                     Previous.InitialCpu.SameState(machine.Cpu);
+    if (Resumable) {
+        for (std::uint32_t Address = 0; Address < Mem::MAX_MEM; Address++) {
+            if (Previous.InitialMemory[Address] != machine.Memory.Data[Address]) {
+                Edited.push_back(Address);
+            }
+        }
+    }
+
+    // Checkpoints are cumulative, so the usable ones form a prefix; keep them with the edits applied.
+    MemHeatmap Touched;
+    for (CheckpointLog::Checkpoint& Entry : Previous.Checkpoints) {
+        if (!Resumable || Entry.State.Cpu.TotalCycles > Cycles ||
+            std::any_of(Edited.begin(), Edited.end(), [&](std::uint32_t Address) { return Entry.WasTouched(Address); })) {
+            break;
+        }
+        for (std::uint32_t Address : Edited) {
+            Entry.State.Memory.Data[Address] = machine.Memory.Data[Address];
+        }
+        Log.Checkpoints.push_back(std::move(Entry));
+    }
+    if (!Log.Checkpoints.empty()) {
+        const CheckpointLog::Checkpoint& Resume = Log.Checkpoints.back();
+        machine = Resume.State;
+        // Carry the touched set forward so later checkpoints stay cumulative.
+        for (std::uint32_t Address = 0; Address < Mem::MAX_MEM; Address++) {
+            Touched.Reads[Address] = Resume.WasTouched(Address);
+        }
+        std::cerr << "Resuming from checkpoint at cycle " << machine.Cpu.TotalCycles << std::endl;
+    }
+
+    machine.Cpu.Heatmap = &Touched;
+    if (machine.Cpu.Input != nullptr) {
+        machine.Cpu.Input->Record = &Log.Inputs;
+    }
+    while (machine.Cpu.TotalCycles < Cycles) {
+        std::uint64_t Next = std::min<std::uint64_t>(Cycles, (machine.Cpu.TotalCycles / Interval + 1) * Interval);
+        machine.Cpu.Execute(static_cast<std::uint32_t>(Next - machine.Cpu.TotalCycles), machine.Memory);
+        if (machine.Cpu.TotalCycles < Cycles) {
+            Log.Checkpoints.emplace_back();
+            CheckpointLog::Checkpoint& Entry = Log.Checkpoints.back();
+            Entry.State = machine;
+            Entry.State.Cpu.DetachHooks();
+            for (std::uint32_t Address = 0; Address < Mem::MAX_MEM; Address++) {
+                if (Touched.Reads[Address] | Touched.Writes[Address] | Touched.Executes[Address]) {
+                    Entry.Touched[Address / 8] |= static_cast<std::uint8_t>(1 << (Address % 8));
+                }
+            }
+        }
+    }
+    machine.Cpu.Heatmap = nullptr;
+    if (machine.Cpu.Input != nullptr) {
+        machine.Cpu.Input->Record = nullptr;
+    }
+    Log.Save(LogPath);
+    return SummariseMachine(machine, CaptureAddress);
+}
+
+// This struct is a fixed pool of worker threads running queued tasks.
+// Tasks should be short: long-running work re-posts itself instead of holding a worker.
+struct Executor {
+    std::mutex Lock;
+    std::condition_variable Wake;
+    std::deque<std::function<void()>> Queue;
+    std::vector<std::thread> Workers;
+    bool Stopping = false;
+
+    explicit Executor(unsigned Threads = std::max(1u, std::thread::hardware_concurrency())) {
+        for (unsigned i = 0; i < Threads; i++) {
+            Workers.emplace_back([this]() { WorkerLoop(); });
+        }
+    }
+
+    // Finishes every queued task, then joins the workers.
+    ~Executor() {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            Stopping = true;
+        }
+        Wake.notify_all();
+        for (std::thread& Worker : Workers) {
+            Worker.join();
+        }
+    }
+
+    void Post(std::function<void()> Task) {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            Queue.push_back(std::move(Task));
+        }
+        Wake.notify_one();
+    }
+
+    void WorkerLoop() {
+        for (;;) {
+            std::function<void()> Task;
+            {
+                std::unique_lock<std::mutex> Guard(Lock);
+                Wake.wait(Guard, [this]() { return Stopping || !Queue.empty(); });
+                if (Queue.empty()) {
+                    return;
+                }
+                Task = std::move(Queue.front());
+                Queue.pop_front();
+            }
+            Task();
+        }
+    }
+};
+
+// Replays the part of a checkpointed run from machine's current state up to cycle End, with the
+// recorded input and the same Execute budgets as the recording, so it runs exactly as it did.
+// No budget reaches past End, even if the log's checkpoints are off its Interval grid.
+void ReplaySegment(Machine& machine, const CheckpointLog& Log, std::uint64_t End) {
+    auto Input = std::make_unique<InputPort>();
+    Input->ReplayNext = std::lower_bound(Log.Inputs.data(), Log.Inputs.data() + Log.Inputs.size(), machine.Cpu.TotalCycles,
+                                         [](const InputEvent& Event, std::uint64_t Cycle) { return Event.Cycle < Cycle; });
+    Input->ReplayEnd = Log.Inputs.data() + Log.Inputs.size();
+    machine.Cpu.Input = Input.get();
+    while (machine.Cpu.TotalCycles < End) {
+        std::uint64_t Next = std::min<std::uint64_t>({ End, Log.Cycles, (machine.Cpu.TotalCycles / Log.Interval + 1) * Log.Interval });
+        machine.Cpu.Execute(static_cast<std::uint32_t>(Next - machine.Cpu.TotalCycles), machine.Memory);
+    }
+    machine.Cpu.Input = nullptr;
+}
+
+// Regenerates a detailed trace of the run recorded in the checkpoint log at LogPath (written by
+// main --run with --checkpoint-every). Every segment between consecutive checkpoints is replayed
+// in parallel on Jobs threads with tracing (and optionally a heatmap) enabled; each writes a
+// trace fragment, and the fragments are stitched in order into TracePath. Each replayed segment
+// is checked against the next checkpoint, so a divergent replay is reported rather than hidden.
+// main --regenerate LOG --trace out.json [--heatmap PREFIX] [--jobs N]
+int RegenerateTrace(const char* LogPath, const char* TracePath, const std::string& HeatmapPrefix, unsigned Jobs) {
+    CheckpointLog Log;
+    if (!Log.Load(LogPath) || Log.Interval == 0) {
+        std::cerr << "Cannot read checkpoint log " << LogPath << std::endl;
+        return 1;
+    }
+
+    // This struct is the outcome of one replayed segment.
+    struct Segment {
+        std::string FragmentPath;
+        std::uint32_t Depth = 0;
+        std::vector<std::pair<std::uint64_t, std::uint32_t>> Unmatched;
+        bool Diverged = false;
+        MemHeatmap Heatmap;
+    };
+    std::size_t Count = Log.Checkpoints.size() + 1;
+    std::vector<std::unique_ptr<Segment>> Segments(Count);
+    std::atomic<bool> Failed { false };
+    {
+        Executor Pool(Jobs);
+        for (std::size_t i = 0; i < Count; i++) {
+            Segments[i] = std::make_unique<Segment>();
+            Segments[i]->FragmentPath = std::string(TracePath) + ".part" + std::to_string(i);
+            Pool.Post([&Log, &Failed, &HeatmapPrefix, Part = Segments[i].get(), i, Count]() {
+                auto machine = std::make_unique<Machine>();
+                if (i == 0) {
+                    machine->Cpu = Log.InitialCpu;
+                    std::memcpy(machine->Memory.Data, Log.InitialMemory.data(), Mem::MAX_MEM);
+                } else {
+                    *machine = Log.Checkpoints[i - 1].State;
+                }
+                std::uint64_t End = i + 1 < Count ? Log.Checkpoints[i].State.Cpu.TotalCycles : Log.Cycles;
+                TraceWriter Trace;
+                Trace.Fragment = true;
+                if (!Trace.Open(Part->FragmentPath.c_str())) {
+                    Failed = true;
+                    return;
+                }
+                machine->Cpu.Trace = &Trace;
+                if (!HeatmapPrefix.empty()) {
+                    machine->Cpu.Heatmap = &Part->Heatmap;
+                }
+                ReplaySegment(*machine, Log, End);
+                machine->Cpu.DetachHooks();
+                Trace.Close();
+                Part->Depth = Trace.Depth;
+                Part->Unmatched = std::move(Trace.Unmatched);
+                if (i + 1 < Count) {
+                    const Machine& Expected = Log.Checkpoints[i].State;
+                    Part->Diverged = !machine->Cpu.SameState(Expected.Cpu) ||
+                                     std::memcmp(machine->Memory.Data, Expected.Memory.Data, Mem::MAX_MEM) != 0;
+                }
+            });
+        }
+    }
+    if (Failed) {
+        std::cerr << "Cannot write trace fragments next to " << TracePath << std::endl;
+        return 1;
+    }
+
+    // Stitch: fragments are event lists, so they concatenate; a return in one fragment closes a
+    // frame left open by the ones before it. Returns beyond the frames still open close nothing
+    // and are dropped, as a serial TraceWriter drops them.
+    TraceWriter Trace;
+    if (!Trace.Open(TracePath)) {
+        std::cerr << "Cannot open trace file " << TracePath << std::endl;
+        return 1;
+    }
+    MemHeatmap Heatmap;
+    std::uint32_t Open = 0;
+    int Status = 0;
+    std::vector<char> Chunk(TraceWriter::FLUSH_SIZE);
+    for (std::size_t i = 0; i < Count; i++) {
+        const Segment& Part = *Segments[i];
+        if (Part.Diverged) {
+            std::cerr << "Segment " << i << " diverged from the recorded run" << std::endl;
+            Status = 1;
+        }
+        std::FILE* Fragment = std::fopen(Part.FragmentPath.c_str(), "rb");
+        // Copies up to Bytes bytes of the fragment.
+        auto Copy = [&](std::uint64_t Bytes) {
+            while (Bytes > 0) {
+                std::size_t Size = std::fread(Chunk.data(), 1, static_cast<std::size_t>(std::min<std::uint64_t>(Bytes, Chunk.size())), Fragment);
+                if (Size == 0) {
+                    break;
+                }
+                Trace.Append(Chunk.data(), Size);
+                Bytes -= Size;
+            }
+        };
+        std::size_t Closing = std::min<std::size_t>(Open, Part.Unmatched.size());
+        if (Fragment != nullptr) {
+            std::uint64_t Position = 0;
+            for (std::size_t j = Closing; j < Part.Unmatched.size(); j++) {
+                Copy(Part.Unmatched[j].first - Position);
+                Position = Part.Unmatched[j].first + Part.Unmatched[j].second;
+                std::fseek(Fragment, static_cast<long>(Position), SEEK_SET);
+            }
+            Copy(UINT64_MAX);
+            std::fclose(Fragment);
+        }
+        std::remove(Part.FragmentPath.c_str());
+        Open = Open - static_cast<std::uint32_t>(Closing) + Part.Depth;
+        if (!HeatmapPrefix.empty()) {
+            Heatmap.Merge(Part.Heatmap);
+        }
+    }
+    Trace.Depth = Open;
+    Trace.Close(Log.Cycles);
+    if (!HeatmapPrefix.empty()) {
+        Heatmap.WriteCSV((HeatmapPrefix + ".csv").c_str());
+        Heatmap.WritePPM((HeatmapPrefix + ".ppm").c_str());
+    }
+    std::cerr << "Regenerated " << Count << " segments" << std::endl;
+    return Status;
+}
+
+// This struct is the handle of a machine running asynchronously on an Executor.
+// The machine runs in blocks of BlockCycles; between blocks a single atomic load checks for
+// pause/stop requests. A paused machine gives its worker thread back until Resume is called.
+struct MachineRun : std::enable_shared_from_this<MachineRun> {
+    static constexpr std::uint32_t CONTROL_PAUSE = 1, CONTROL_STOP = 2;
+    // Blocks run before the task re-posts itself, so many machines share few workers fairly.
+    static constexpr std::uint32_t BLOCKS_PER_TURN = 64;
+
+    Executor& Pool;
+    std::unique_ptr<Machine> Owned;
+    std::uint32_t BlockCycles;
+    // Start of the memory range captured in the final RunResult.
+    std::uint16_t CaptureAddress = 0;
+    std::atomic<std::uint32_t> Control { 0 };
+    std::atomic<std::uint64_t> TargetCycles;
+    // Guards Parked against a concurrent Resume.
+    std::mutex ParkLock;
+    bool Parked = false;
+    std::promise<RunResult> Done;
+    std::shared_future<RunResult> Result;
+
+    MachineRun(Executor& pool, std::unique_ptr<Machine> machine, std::uint64_t Cycles, std::uint32_t blockCycles)
+        : Pool(pool), Owned(std::move(machine)), BlockCycles(blockCycles), TargetCycles(Cycles), Result(Done.get_future().share()) {}
+
+    // Requests a pause; honoured at the next block boundary.
+    void Pause() {
+        Control.fetch_or(CONTROL_PAUSE);
+    }
+
+    // Continues a paused machine.
+    void Resume() {
+        std::lock_guard<std::mutex> Guard(ParkLock);
+        Control.fetch_and(~CONTROL_PAUSE);
+        if (Parked) {
+            Parked = false;
+            Schedule();
+        }
+    }
+
+    // Ends the run at the next block boundary (also ends a paused run).
+    void Stop() {
+        Control.fetch_or(CONTROL_STOP);
+        Resume();
+    }
+
+    // Raises the cycle budget by Cycles. Has no effect once the run has completed.
+    void ExtendBudget(std::uint64_t Cycles) {
+        TargetCycles.fetch_add(Cycles);
+    }
+
+    // Becomes ready with the final state when the run ends.
+    std::shared_future<RunResult> Completion() const {
+        return Result;
+    }
+
+    // True once a requested pause has taken effect (the machine is between blocks).
+    bool IsPaused() {
+        std::lock_guard<std::mutex> Guard(ParkLock);
+        return Parked;
+    }
+
+    // The machine; only safe to inspect while IsPaused() or after completion.
+    Machine& GetMachine() {
+        return *Owned;
+    }
+
+    void Schedule() {
+        Pool.Post([Self = shared_from_this()]() { Self->RunTurn(); });
+    }
+
+    void RunTurn() {
+        Machine& machine = *Owned;
+        for (std::uint32_t Block = 0; Block < BLOCKS_PER_TURN; Block++) {
+            std::uint64_t Target = TargetCycles.load(std::memory_order_relaxed);
+            if (machine.Cpu.TotalCycles >= Target) {
+                Finish(StopReason::BudgetExhausted);
+                return;
+            }
+            if (Control.load(std::memory_order_acquire) != 0) {
+                if (Control.load() & CONTROL_STOP) {
+                    Finish(StopReason::Stopped);
+                    return;
+                }
+                std::lock_guard<std::mutex> Guard(ParkLock);
+                if (Control.load() & CONTROL_PAUSE) {
+                    Parked = true;
+                    return;
+                }
+            }
+            std::uint64_t Remaining = Target - machine.Cpu.TotalCycles;
+            machine.Cpu.Execute(static_cast<std::uint32_t>(std::min<std::uint64_t>(Remaining, BlockCycles)), machine.Memory);
+        }
+        Schedule();
+    }
+
+    void Finish(StopReason Reason) {
+        RunResult Final = SummariseMachine(*Owned, CaptureAddress);
+        Final.Reason = Reason;
+        Done.set_value(Final);
+    }
+};
+
+// Starts machine on Pool and returns its handle.
+std::shared_ptr<MachineRun> StartMachine(Executor& Pool, std::unique_ptr<Machine> machine, std::uint64_t Cycles,
+                                         std::uint32_t BlockCycles = 10000, std::uint16_t CaptureAddress = 0) {
+    auto Run = std::make_shared<MachineRun>(Pool, std::move(machine), Cycles, BlockCycles);
+    Run->CaptureAddress = CaptureAddress;
+    Run->Schedule();
+    return Run;
+}
+
+#if defined(__unix__)
+// This struct is one job slot in the memory shared between the supervisor and worker processes.
+// Claim is 0 while pending, (pid << 8) | CLAIM_RUNNING while a worker runs it, then CLAIM_DONE or
+// CLAIM_FAILED. Workers write Result in place, so results come back without copying.
+struct WorkerSlot {
+    static constexpr std::uint64_t CLAIM_RUNNING = 1, CLAIM_DONE = 2, CLAIM_FAILED = 3;
+    // A job whose worker crashed this many times is reported as crashed instead of retried.
+    static constexpr std::uint32_t MAX_ATTEMPTS = 2;
+
+    std::atomic<std::uint64_t> Claim;
+    std::uint32_t Attempts;
+    RunResult Result;
+};
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "shared-memory claims need lock-free atomics");
+
+// Worker process body: claims pending jobs until none are left.
+[[noreturn]] void WorkerProcess(const Machine* Images, WorkerSlot* Slots, std::size_t Count, std::uint32_t Cycles,
+                                std::uint16_t CaptureAddress) {
+    std::uint64_t Running = (static_cast<std::uint64_t>(getpid()) << 8) | WorkerSlot::CLAIM_RUNNING;
+    auto machine = std::make_unique<Machine>();
+    for (std::size_t i = 0; i < Count; i++) {
+        std::uint64_t Pending = 0;
+        if (!Slots[i].Claim.compare_exchange_strong(Pending, Running)) {
+            continue;
+        }
+        // The image is read-only shared memory; run on a private copy.
+        *machine = Images[i];
+        Slots[i].Result = RunMachine(*machine, Cycles, CaptureAddress);
+        Slots[i].Claim.store(WorkerSlot::CLAIM_DONE, std::memory_order_release);
+    }
+    // _exit: the buffered output inherited from the supervisor must not be flushed twice.
+    std::fflush(nullptr);
+    _exit(0);
+}
+
+// Runs each of Initial for Cycles cycles in Workers forked worker processes, isolating the
+// supervisor from crashes. Images are placed in a shared mapping that is made read-only before
+// forking; jobs and results live in a second shared mapping. A worker that dies is replaced,
+// and its job is retried up to WorkerSlot::MAX_ATTEMPTS times before being reported as crashed.
+std::vector<RunResult> RunInWorkerProcesses(const std::vector<const Machine*>& Initial, std::uint32_t Cycles, unsigned Workers,
+                                            std::uint16_t CaptureAddress = 0) {
+    std::size_t Count = Initial.size();
+    std::vector<RunResult> Results(Count);
+    if (Count == 0) {
+        return Results;
+    }
+    std::size_t ImageBytes = Count * sizeof(Machine);
+    std::size_t SlotBytes = Count * sizeof(WorkerSlot);
+    void* ImageMap = mmap(nullptr, ImageBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    void* SlotMap = mmap(nullptr, SlotBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ImageMap == MAP_FAILED || SlotMap == MAP_FAILED) {
+        std::cerr << "Cannot map worker memory" << std::endl;
+        std::exit(1);
+    }
+    Machine* Images = static_cast<Machine*>(ImageMap);
+    WorkerSlot* Slots = static_cast<WorkerSlot*>(SlotMap);
+    for (std::size_t i = 0; i < Count; i++) {
+        Images[i] = *Initial[i];
+        new (&Slots[i]) WorkerSlot { { 0 }, 0, RunResult() };
+    }
+    mprotect(ImageMap, ImageBytes, PROT_READ);
+
+    std::fflush(nullptr);
+    std::vector<pid_t> Alive;
+    auto Spawn = [&]() {
+        pid_t Child = fork();
+        if (Child == 0) {
+            WorkerProcess(Images, Slots, Count, Cycles, CaptureAddress);
+        }
+        if (Child > 0) {
+            Alive.push_back(Child);
+        }
+    };
+    for (unsigned i = 0; i < std::max(1u, Workers); i++) {
+        Spawn();
+    }
+
+    while (!Alive.empty()) {
+        int WaitStatus = 0;
+        pid_t Child = waitpid(-1, &WaitStatus, 0);
+        if (Child < 0) {
+            break;
+        }
+        Alive.erase(std::remove(Alive.begin(), Alive.end(), Child), Alive.end());
+        bool Crashed = !WIFEXITED(WaitStatus) || WEXITSTATUS(WaitStatus) != 0;
+        if (Crashed) {
+            // Release (or give up on) the job the dead worker was running.
+            std::uint64_t Running = (static_cast<std::uint64_t>(Child) << 8) | WorkerSlot::CLAIM_RUNNING;
+            for (std::size_t i = 0; i < Count; i++) {
+                if (Slots[i].Claim.load() == Running) {
+                    Slots[i].Attempts++;
+                    Slots[i].Claim.store(Slots[i].Attempts < WorkerSlot::MAX_ATTEMPTS ? 0 : WorkerSlot::CLAIM_FAILED);
+                    std::cerr << "Worker " << Child << " crashed on job " << i << std::endl;
+                }
+            }
+        }
+        bool Pending = false;
+        for (std::size_t i = 0; i < Count; i++) {
+            Pending |= Slots[i].Claim.load() == 0;
+        }
+        if (Pending && (Crashed || Alive.empty())) {
+            Spawn();
+        }
+    }
+
+    for (std::size_t i = 0; i < Count; i++) {
+        if (Slots[i].Claim.load() == WorkerSlot::CLAIM_DONE) {
+            Results[i] = Slots[i].Result;
+        } else {
+            Results[i].Reason = StopReason::Crashed;
+        }
+        Slots[i].~WorkerSlot();
+    }
+    munmap(ImageMap, ImageBytes);
+    munmap(SlotMap, SlotBytes);
+    return Results;
+}
+#endif
+
+// This struct streams batch results into a columnar binary file for analysis jobs.
+// Rows are buffered into row groups; each group is written column by column (every column has a
+// fixed width, little-endian), so a reader can mmap the file and touch only the columns it needs.
+// A background thread does all file I/O. The footer, located through the last 16 bytes, is:
+//   "6502COLS" u32 version, u32 columns, per column { char name[16], u32 width },
+//   u32 groups, per group { u64 offset, u32 rows }, u64 footer offset, "6502COLS"
+struct ColumnarWriter {
+    static constexpr char MAGIC[8] = { '6', '5', '0', '2', 'C', 'O', 'L', 'S' };
+    static constexpr std::uint32_t VERSION = 1;
+    static constexpr std::uint32_t ROWS_PER_GROUP = 4096;
+
+    // This struct describes one column and how to extract it from a RunResult.
+    struct Column {
+        const char* Name;
+        std::uint32_t Width;
+        void (*Extract)(const RunResult& Result, std::uint8_t* Out);
+    };
+
+    template <typename T>
+    static void Store(std::uint8_t* Out, T Value) {
+        for (std::size_t i = 0; i < sizeof(T); i++) {
+            Out[i] = static_cast<std::uint8_t>(static_cast<std::uint64_t>(Value) >> (8 * i));
+        }
+    }
+
+    static const std::vector<Column>& Columns() {
+        static const std::vector<Column> Layout = {
+            { "pc",          2, [](const RunResult& R, std::uint8_t* Out) { Store(Out, R.PC); } },
+            { "sp",          2, [](const RunResult& R, std::uint8_t* Out) { Store(Out, R.SP); } },
+            { "a",           1, [](const RunResult& R, std::uint8_t* Out) { Store(Out, R.A); } },
+            { "x",           1, [](const RunResult& R, std::uint8_t* Out) { Store(Out, R.X); } },
+            { "y",           1, [](const RunResult& R, std::uint8_t* Out) { Store(Out, R.Y); } },
+            { "status",      1, [](const RunResult& R, std::uint8_t* Out) { Store(Out, R.Status); } },
+            { "cycles",      8, [](const RunResult& R, std::uint8_t* Out) { Store(Out, R.Cycles); } },
+            { "memory_hash", 8, [](const RunResult& R, std::uint8_t* Out) { Store(Out, R.MemoryHash); } },
+            { "stop_reason", 1, [](const RunResult& R, std::uint8_t* Out) { Store(Out, static_cast<std::uint8_t>(R.Reason)); } },
+            { "cached",      1, [](const RunResult& R, std::uint8_t* Out) { Store(Out, R.Cached); } },
+            { "capture_at",  2, [](const RunResult& R, std::uint8_t* Out) { Store(Out, R.CaptureAddress); } },
+            { "capture",     RunResult::CAPTURE_BYTES,
+                               [](const RunResult& R, std::uint8_t* Out) { std::memcpy(Out, R.Capture, RunResult::CAPTURE_BYTES); } },
+        };
+        return Layout;
+    }
+
+    // This struct is a row group being filled: one buffer per column.
+    struct RowGroup {
+        std::uint32_t Rows = 0;
+        std::vector<std::vector<std::uint8_t>> ColumnData;
+    };
+
+    std::FILE* File = nullptr;
+    RowGroup Current;
+    std::vector<std::pair<std::uint64_t, std::uint32_t>> Groups;
+    std::uint64_t Offset = 0;
+    // Hand-off to the writer thread.
+    std::mutex Lock;
+    std::condition_variable Wake;
+    std::deque<RowGroup> Ready;
+    bool Closing = false;
+    std::thread Writer;
+
+    ~ColumnarWriter() { Close(); }
+
+    bool Open(const char* Path) {
+        File = std::fopen(Path, "wb");
+        if (File == nullptr) {
+            return false;
+        }
+        Current = NewGroup();
+        Writer = std::thread([this]() { WriterLoop(); });
+        return true;
+    }
+
+    // Appends one row.
+    void Append(const RunResult& Result) {
+        const std::vector<Column>& Layout = Columns();
+        for (std::size_t c = 0; c < Layout.size(); c++) {
+            std::vector<std::uint8_t>& Data = Current.ColumnData[c];
+            Data.resize(Data.size() + Layout[c].Width);
+            Layout[c].Extract(Result, &Data[Data.size() - Layout[c].Width]);
+        }
+        if (++Current.Rows == ROWS_PER_GROUP) {
+            Submit();
+        }
+    }
+
+    // Flushes the last row group, waits for the writer thread and writes the footer.
+    void Close() {
+        if (File == nullptr) {
+            return;
+        }
+        if (Current.Rows > 0) {
+            Submit();
+        }
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            Closing = true;
+        }
+        Wake.notify_one();
+        Writer.join();
+
+        const std::vector<Column>& Layout = Columns();
+        std::vector<std::uint8_t> Footer(MAGIC, MAGIC + sizeof(MAGIC));
+        auto Put = [&](auto Value) {
+            std::uint8_t Bytes[sizeof(Value)];
+            Store(Bytes, Value);
+            Footer.insert(Footer.end(), Bytes, Bytes + sizeof(Bytes));
+        };
+        Put(VERSION);
+        Put(static_cast<std::uint32_t>(Layout.size()));
+        for (const Column& Entry : Layout) {
+            char Name[16] = {};
+            std::strncpy(Name, Entry.Name, sizeof(Name) - 1);
+            Footer.insert(Footer.end(), Name, Name + sizeof(Name));
+            Put(Entry.Width);
+        }
+        Put(static_cast<std::uint32_t>(Groups.size()));
+        for (const auto& Group : Groups) {
+            Put(Group.first);
+            Put(Group.second);
+        }
+        Put(Offset);
+        Footer.insert(Footer.end(), MAGIC, MAGIC + sizeof(MAGIC));
+        std::fwrite(Footer.data(), 1, Footer.size(), File);
+        std::fclose(File);
+        File = nullptr;
+    }
+
+    RowGroup NewGroup() const {
+        RowGroup Group;
+        Group.ColumnData.resize(Columns().size());
+        for (std::size_t c = 0; c < Columns().size(); c++) {
+            Group.ColumnData[c].reserve(ROWS_PER_GROUP * Columns()[c].Width);
+        }
+        return Group;
+    }
+
+    void Submit() {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            Ready.push_back(std::move(Current));
+        }
+        Wake.notify_one();
+        Current = NewGroup();
+    }
+
+    void WriterLoop() {
+        for (;;) {
+            RowGroup Group;
+            {
+                std::unique_lock<std::mutex> Guard(Lock);
+                Wake.wait(Guard, [this]() { return Closing || !Ready.empty(); });
+                if (Ready.empty()) {
+                    return;
+                }
+                Group = std::move(Ready.front());
+                Ready.pop_front();
+            }
+            Groups.emplace_back(Offset, Group.Rows);
+            for (const std::vector<std::uint8_t>& Data : Group.ColumnData) {
+                std::fwrite(Data.data(), 1, Data.size(), File);
+                Offset += Data.size();
+            }
+        }
+    }
+};
+
+// Parses an unsigned number in decimal, hex (0x) or octal (leading 0) from the whole of Text.
+// @return false (leaving Value unchanged) if Text is not such a number or exceeds Max.
+bool ParseNumber(const char* Text, std::uint64_t Max, std::uint64_t& Value) {
+    if (*Text < '0' || *Text > '9') {
+        return false;
+    }
+    char* End = nullptr;
+    errno = 0;
+    unsigned long long Parsed = std::strtoull(Text, &End, 0);
+    if (errno != 0 || *End != '\0' || Parsed > Max) {
+        return false;
+    }
+    Value = Parsed;
+    return true;
+}
+
+// Loads "path" or "path@base" (base defaults to 0, i.e. a full 64 KiB memory image) into a
+// machine in its post-reset state.
+// @return false if the base is not a number below Mem::MAX_MEM or the file could not be read.
+bool LoadBatchImage(Machine& machine, const std::string& Spec) {
+    std::string Path = Spec;
+    std::uint64_t Base = 0;
+    std::size_t At = Spec.rfind('@');
+    if (At != std::string::npos) {
+        Path = Spec.substr(0, At);
+        if (!ParseNumber(Spec.c_str() + At + 1, Mem::MAX_MEM - 1, Base)) {
+            return false;
+        }
+    }
+    machine.Cpu = CPU(0xFFFC);
+    machine.Memory = Mem(nullptr, 0, 0);
+    return LoadImage(machine.Memory, Path.c_str(), static_cast<std::uint32_t>(Base));
+}
+
+// Formats one result line for Image.
+std::string FormatRunResult(const std::string& Image, const RunResult& Result) {
+    char Line[256];
+    std::snprintf(Line, sizeof(Line), "%s: PC=%04X SP=%04X A=%02X X=%02X Y=%02X P=%02X cycles=%llu mem=%016llx%s\n", Image.c_str(),
+                  Result.PC, Result.SP, Result.A, Result.X, Result.Y, Result.Status,
+                  static_cast<unsigned long long>(Result.Cycles), static_cast<unsigned long long>(Result.MemoryHash),
+                  Result.Cached ? " (cached)" : Result.Reason == StopReason::Crashed ? " (crashed)" :
+                  Result.Reason == StopReason::Stopped ? " (stopped)" : "");
+    return Line;
+}
+
+// Prints one result line for Image.
+void PrintRunResult(const std::string& Image, const RunResult& Result) {
+    std::fputs(FormatRunResult(Image, Result).c_str(), stdout);
+}
+
+// Runs each image for Cycles cycles and prints its final state.
+// main --run CYCLES [--cache DIR [--checkpoint-every N]] [--jobs N] IMAGE[@BASE]...
+// With --checkpoint-every, runs of an image are checkpointed in DIR and re-runs after small edits
+// resume from the last checkpoint unaffected by the edit. The logs (DIR/*.ckpt) also feed
+// main --regenerate, which rebuilds a full trace of the run in parallel (see RegenerateTrace).
+// With --jobs, images run concurrently on an Executor of N threads (not with --checkpoint-every).
+// With --workers, images run in N forked worker processes so a crash cannot take down the batch
+// (not with --checkpoint-every, which is rejected: workers neither checkpoint nor resume).
+// With --capture ADDR, RunResult::CAPTURE_BYTES bytes from ADDR are kept in each result.
+// With --columnar FILE, results go to a columnar file (see ColumnarWriter) instead of stdout.
+int RunBatch(int argc, const char* argv[]) {
+    // Reads the numeric argument Text into Value, reporting it if it is not a number up to Max.
+    bool Valid = true;
+    auto Number = [&](const char* Text, std::uint64_t Max, auto& Value) {
+        std::uint64_t Parsed = 0;
+        if (!ParseNumber(Text, Max, Parsed)) {
+            std::cerr << "Invalid number " << Text << std::endl;
+            Valid = false;
+        }
+        Value = static_cast<std::remove_reference_t<decltype(Value)>>(Parsed);
+    };
+    std::uint32_t Cycles = 0;
+    Number(argv[2], UINT32_MAX, Cycles);
+    std::uint32_t CheckpointInterval = 0;
+    unsigned Jobs = 0;
+    unsigned Workers = 0;
+    std::uint16_t CaptureAddress = 0;
+    ColumnarWriter Columnar;
+    ResultCache Cache;
+    std::vector<std::string> Images;
+    for (int i = 3; i < argc; i++) {
+        if (std::string(argv[i]) == "--cache" && i + 1 < argc) {
+            Cache.Directory = argv[++i];
+        } else if (std::string(argv[i]) == "--checkpoint-every" && i + 1 < argc) {
+            Number(argv[++i], UINT32_MAX, CheckpointInterval);
+        } else if (std::string(argv[i]) == "--jobs" && i + 1 < argc) {
+            Number(argv[++i], UINT16_MAX, Jobs);
+        } else if (std::string(argv[i]) == "--workers" && i + 1 < argc) {
+            Number(argv[++i], UINT16_MAX, Workers);
+        } else if (std::string(argv[i]) == "--capture" && i + 1 < argc) {
+            Number(argv[++i], Mem::MAX_MEM - 1, CaptureAddress);
+        } else if (std::string(argv[i]) == "--columnar" && i + 1 < argc) {
+            if (!Columnar.Open(argv[++i])) {
+                std::cerr << "Cannot create " << argv[i] << std::endl;
+                return 1;
+            }
+        } else {
+            Images.push_back(argv[i]);
+        }
+    }
+    if (!Valid) {
+        return 1;
+    }
+    if (Workers > 0 && CheckpointInterval > 0) {
+        std::cerr << "--workers cannot be combined with --checkpoint-every" << std::endl;
+        return 1;
+    }
+    std::unique_ptr<Executor> Pool;
+    if (Jobs > 0 && CheckpointInterval == 0) {
+        Pool = std::make_unique<Executor>(Jobs);
+    }
+
+    int Status = 0;
+    std::vector<RunResult> Results(Images.size());
+    std::vector<std::uint64_t> Keys(Images.size());
+    std::vector<bool> Loaded(Images.size(), false);
+    std::vector<std::shared_ptr<MachineRun>> Running(Images.size());
+    // Machines left for the worker processes, and their indices.
+    std::vector<std::unique_ptr<Machine>> Deferred;
+    std::vector<std::size_t> DeferredIndex;
+    for (std::size_t i = 0; i < Images.size(); i++) {
+        const std::string& Image = Images[i];
+        // Heap-allocated: a Machine is 64 KiB.
+        auto machine = std::make_unique<Machine>();
+        if (!LoadBatchImage(*machine, Image)) {
+            std::cerr << "Cannot load image " << Image << std::endl;
+            Status = 1;
+            continue;
+        }
+        Loaded[i] = true;
+        Keys[i] = RunKey(*machine, Cycles, CaptureAddress);
+        if (!Cache.Directory.empty() && Cache.Load(Keys[i], Results[i])) {
+            continue;
+        }
+#if defined(__unix__)
+        if (Workers > 0) {
+            Deferred.push_back(std::move(machine));
+            DeferredIndex.push_back(i);
+            continue;
+        }
+#endif
+        if (Pool) {
+            Running[i] = StartMachine(*Pool, std::move(machine), Cycles, 10000, CaptureAddress);
+            continue;
+        }
+        if (CheckpointInterval > 0 && !Cache.Directory.empty()) {
+            // Checkpoints are kept per image name, so an edited image finds its previous run.
+            char Name[32];
+            std::snprintf(Name, sizeof(Name), "%016llx.ckpt", static_cast<unsigned long long>(
+                HashBytes(reinterpret_cast<const std::uint8_t*>(Image.data()), Image.size())));
+            Results[i] = RunIncremental(*machine, Cycles, CheckpointInterval, Cache.Directory / Name, CaptureAddress);
+        } else {
+            Results[i] = RunMachine(*machine, Cycles, CaptureAddress);
+        }
+        if (!Cache.Directory.empty()) {
+            Cache.Store(Keys[i], Results[i]);
+        }
+    }
+#if defined(__unix__)
+    if (!Deferred.empty()) {
+        std::vector<const Machine*> Initial;
+        for (const auto& machine : Deferred) {
+            Initial.push_back(machine.get());
+        }
+        std::vector<RunResult> WorkerResults = RunInWorkerProcesses(Initial, Cycles, Workers, CaptureAddress);
+        for (std::size_t j = 0; j < DeferredIndex.size(); j++) {
+            Results[DeferredIndex[j]] = WorkerResults[j];
+            if (!Cache.Directory.empty() && WorkerResults[j].Reason != StopReason::Crashed) {
+                Cache.Store(Keys[DeferredIndex[j]], WorkerResults[j]);
+            }
+        }
+    }
+#endif
+    for (std::size_t i = 0; i < Images.size(); i++) {
+        if (Running[i]) {
+            Results[i] = Running[i]->Completion().get();
+            if (!Cache.Directory.empty()) {
+                Cache.Store(Keys[i], Results[i]);
+            }
+        }
+        if (!Loaded[i]) {
+            continue;
+        }
+        if (Columnar.File != nullptr) {
+            Columnar.Append(Results[i]);
+        } else {
+            PrintRunResult(Images[i], Results[i]);
+        }
+    }
+    Columnar.Close();
+    return Status;
+}
+
+
+#if defined(__unix__)
+// This struct is the daemon's warm state for one image: the machine loaded and in its post-reset
+// state, kept until the file changes on disk.
+struct WarmImage {
+    std::unique_ptr<Machine> Booted;
+    // Modification time in nanoseconds and size of the file when it was loaded.
+    std::int64_t ModifiedTime = 0;
+    std::int64_t Size = 0;
+    std::uint64_t LastUsed = 0;
+};
+
+// Serves run requests on a Unix socket, keeping booted machines warm between jobs.
+// Each connection sends one line, "RUN CYCLES IMAGE[@BASE]" or "QUIT", and receives one result
+// line (the same format as --run) or "ERROR ...". Each job runs in a child forked from the warm
+// machine, so it starts without process startup, Reset or loading, and a crashing job only
+// takes down its child. At most MAX_WARM images are kept; the least recently used is dropped.
+// A client gets REQUEST_TIMEOUT_MS to send its request line, so an idle connection cannot stall
+// the others for longer than that.
+int RunDaemon(const char* SocketPath) {
+    static constexpr std::size_t MAX_WARM = 64;
+    static constexpr int REQUEST_TIMEOUT_MS = 2000;
+
+    int Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un Address;
+    std::memset(&Address, 0, sizeof(Address));
+    Address.sun_family = AF_UNIX;
+    std::strncpy(Address.sun_path, SocketPath, sizeof(Address.sun_path) - 1);
+    unlink(SocketPath);
+    if (Listener < 0 || bind(Listener, reinterpret_cast<sockaddr*>(&Address), sizeof(Address)) != 0 || listen(Listener, 64) != 0) {
+        std::cerr << "Cannot listen on " << SocketPath << std::endl;
+        return 1;
+    }
+    // Children are reaped automatically, and a client that closes before reading its reply
+    // makes write fail with EPIPE instead of killing the daemon.
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::map<std::string, WarmImage> Warm;
+    std::uint64_t Clock = 0;
+    for (;;) {
+        int Connection = accept(Listener, nullptr, nullptr);
+        if (Connection < 0) {
+            continue;
+        }
+        auto Reply = [&](const std::string& Text) {
+            if (write(Connection, Text.data(), Text.size()) < 0) {
+                // The client went away (EPIPE); nothing to do.
+            }
+        };
+        // Read one request line, giving up once the client has had REQUEST_TIMEOUT_MS.
+        std::string Request;
+        bool Complete = false;
+        auto Deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(REQUEST_TIMEOUT_MS);
+        while (!Complete && Request.size() < 4096) {
+            auto Left = std::chrono::duration_cast<std::chrono::milliseconds>(Deadline - std::chrono::steady_clock::now()).count();
+            pollfd Ready = { Connection, POLLIN, 0 };
+            if (Left <= 0 || poll(&Ready, 1, static_cast<int>(Left)) <= 0) {
+                break;
+            }
+            char Buffer[512];
+            ssize_t Count = read(Connection, Buffer, sizeof(Buffer));
+            if (Count <= 0) {
+                // End of stream also ends the line.
+                Complete = Count == 0;
+                break;
+            }
+            const char* End = std::find(Buffer, Buffer + Count, '\n');
+            Request.append(Buffer, static_cast<std::size_t>(End - Buffer));
+            Complete = End != Buffer + Count;
+        }
+        if (!Complete) {
+            Reply("ERROR incomplete request\n");
+            close(Connection);
+            continue;
+        }
+
+        char Command[16] = {};
+        unsigned long Cycles = 0;
+        char Image[4096] = {};
+        int Fields = std::sscanf(Request.c_str(), "%15s %lu %4095s", Command, &Cycles, Image);
+        if (Fields >= 1 && std::string(Command) == "QUIT") {
+            Reply("OK\n");
+            close(Connection);
+            break;
+        }
+        if (Fields != 3 || std::string(Command) != "RUN" || Cycles > UINT32_MAX) {
+            Reply("ERROR expected RUN CYCLES IMAGE[@BASE] or QUIT\n");
+            close(Connection);
+            continue;
+        }
+
+        // Find or (re)build the warm machine for this image.
+        std::string Spec = Image;
+        std::string Path = Spec.substr(0, Spec.rfind('@'));
+        struct stat Info;
+        if (stat(Path.c_str(), &Info) != 0) {
+            Reply("ERROR cannot load " + Spec + "\n");
+            close(Connection);
+            continue;
+        }
+        // Nanosecond modification time plus size, so an edit within the same second is seen.
+        std::int64_t ModifiedTime = static_cast<std::int64_t>(Info.st_mtim.tv_sec) * 1000000000 + Info.st_mtim.tv_nsec;
+        WarmImage& Entry = Warm[Spec];
+        if (!Entry.Booted || Entry.ModifiedTime != ModifiedTime || Entry.Size != static_cast<std::int64_t>(Info.st_size)) {
+            Entry.Booted = std::make_unique<Machine>();
+            Entry.ModifiedTime = ModifiedTime;
+            Entry.Size = static_cast<std::int64_t>(Info.st_size);
+            if (!LoadBatchImage(*Entry.Booted, Spec)) {
+                Warm.erase(Spec);
+                Reply("ERROR cannot load " + Spec + "\n");
+                close(Connection);
+                continue;
+            }
+        }
+        Entry.LastUsed = ++Clock;
+        if (Warm.size() > MAX_WARM) {
+            auto Oldest = std::min_element(Warm.begin(), Warm.end(), [](const auto& Left, const auto& Right) {
+                return Left.second.LastUsed < Right.second.LastUsed;
+            });
+            Warm.erase(Oldest);
+        }
+
+        std::fflush(nullptr);
+        pid_t Child = fork();
+        if (Child == 0) {
+            // The child's copy of the warm machine is copy-on-write; run it in place.
+            Machine& machine = *Warm[Spec].Booted;
+            RunResult Result = RunMachine(machine, static_cast<std::uint32_t>(Cycles));
+            Reply(FormatRunResult(Spec, Result));
+            close(Connection);
+            std::fflush(nullptr);
+            _exit(0);
+        }
+        if (Child < 0) {
+            Reply("ERROR fork failed\n");
+        }
+        close(Connection);
+    }
+    close(Listener);
+    unlink(SocketPath);
+    return 0;
+}
+#endif
+
+
+// This is the main function of the program.
+int main(int argc, const char * argv[]) {
+    // Per-opcode microbenchmark: main --bench-opcodes [iterations]
+    if (argc >= 2 && std::string(argv[1]) == "--bench-opcodes") {
+        return BenchOpcodes(argc >= 3 ? static_cast<std::uint32_t>(std::stoul(argv[2])) : 20);
+    }
+    // Machine-density benchmark: main --bench-density [budget MiB]
+    if (argc >= 2 && std::string(argv[1]) == "--bench-density") {
+        return BenchDensity(argc >= 3 ? std::stoull(argv[2]) : 1024);
+    }
+    // Interrupt-latency benchmark: main --bench-irq [samples]
+    if (argc >= 2 && std::string(argv[1]) == "--bench-irq") {
+        return BenchInterruptLatency(argc >= 3 ? static_cast<std::uint32_t>(std::stoul(argv[2])) : 1000);
+    }
+
+    // Threaded-device determinism check: main --check-devices [runs]
+    if (argc >= 2 && std::string(argv[1]) == "--check-devices") {
+        return CheckDevices(argc >= 3 ? static_cast<std::uint32_t>(std::stoul(argv[2])) : 20);
+    }
+
+    // Batch runner: main --run CYCLES [options] IMAGE[@BASE]... (see RunBatch)
+    if (argc >= 3 && std::string(argv[1]) == "--run") {
+        return RunBatch(argc, argv);
+    }
+
+    // Parallel trace regeneration from a checkpoint log (see RegenerateTrace)
+    if (argc >= 3 && std::string(argv[1]) == "--regenerate") {
+        const char* TracePath = nullptr;
+        std::string HeatmapPrefix;
+        unsigned Jobs = std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 3; i + 1 < argc; i += 2) {
+            std::string Option = argv[i];
+            if (Option == "--trace") {
+                TracePath = argv[i + 1];
+            } else if (Option == "--heatmap") {
+                HeatmapPrefix = argv[i + 1];
+            } else if (Option == "--jobs") {
+                Jobs = std::max(1u, static_cast<unsigned>(std::stoul(argv[i + 1])));
+            }
+        }
+        if (TracePath == nullptr) {
+            std::cerr << "Usage: main --regenerate LOG --trace out.json [--heatmap PREFIX] [--jobs N]" << std::endl;
+            return 1;
+        }
+        return RegenerateTrace(argv[2], TracePath, HeatmapPrefix, Jobs);
+    }
+
+#if defined(__unix__)
+    // Emulation daemon: main --daemon SOCKET (see RunDaemon)
+    if (argc >= 3 && std::string(argv[1]) == "--daemon") {
+        return RunDaemon(argv[2]);
+    }
+#endif
+
+    // Generate a header embedding a ROM image: main --embed-rom rom.bin NAME
+    if (argc >= 4 && std::string(argv[1]) == "--embed-rom") {
+        return EmbedRom(argv[2], argv[3]);
+    }
+
+    // Generate the opcode set of a ROM-specialised build: main --specialize rom.bin base
+    if (argc >= 4 && std::string(argv[1]) == "--specialize") {
+        return SpecializeForRom(argv[2], static_cast<std::uint32_t>(std::stoul(argv[3], nullptr, 0)));
+    }
+
+    // Print the recovered control-flow graph of a ROM: main --cfg rom.bin base
+    if (argc >= 4 && std::string(argv[1]) == "--cfg") {
+        return PrintControlFlow(argv[2], static_cast<std::uint32_t>(std::stoul(argv[3], nullptr, 0)));
+    }
+
+    // The machine is constant-initialised (see BootMachine): the CPU is already in its reset
+    // state and the program is already in memory, so there is no Reset or loading to do.
+    Mem& mem = BootMachine.Memory;
+    CPU& cpu = BootMachine.Cpu;
+
+    // Optionally write a Chrome trace of the call stack: main --trace out.json
+    // and/or a memory access heatmap: main --heatmap prefix (writes prefix.csv and prefix.ppm)
+    // Trace frames are named from main --symbols FILE (an ld65 debug file or label map).
+    // Audio of the sound device at $D400 is rendered with main --sound out.wav, on a thread of
+    // its own with --sound-thread.
+    TraceWriter trace;
+    SymbolTable symbols;
+    SoundDevice sound;
+    MemHeatmap heatmap;
+    std::string HeatmapPrefix;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string(argv[i]) == "--trace") {
+            if (!trace.Open(argv[i + 1])) {
+                std::cerr << "Cannot open trace file " << argv[i + 1] << std::endl;
+                return 1;
+            }
+            cpu.Trace = &trace;
+        } else if (std::string(argv[i]) == "--heatmap") {
+            HeatmapPrefix = argv[i + 1];
+            cpu.Heatmap = &heatmap;
+        } else if (std::string(argv[i]) == "--symbols") {
+            if (!symbols.Load(argv[i + 1])) {
+                std::cerr << "Cannot read symbols " << argv[i + 1] << std::endl;
+                return 1;
+            }
+            trace.Symbols = &symbols;
+        } else if (std::string(argv[i]) == "--sound") {
+            if (!sound.OpenWav(argv[i + 1])) {
+                std::cerr << "Cannot open sound file " << argv[i + 1] << std::endl;
+                return 1;
+            }
+            cpu.Sound = &sound;
+        }
+    }
+    bool SoundThread = std::find_if(argv + 1, argv + argc, [](const char* Arg) { return std::string(Arg) == "--sound-thread"; }) != argv + argc;
+
+    // Execute the CPU instructions for 2 cycles using the provided memory.
+    if (SoundThread && cpu.Sound != nullptr) {
+        // The sound device never affects the CPU, so its lookahead is unbounded.
+        cpu.Sound = nullptr;
+        DeviceThread<SoundDevice> Device(sound, SoundDevice::BASE, 0xFC00, UINT32_MAX);
+        DeviceBus Bus;
+        Bus.Links.push_back(&Device.Link);
+        RunWithDevices(BootMachine, Bus, 9);
+    } else {
+        cpu.Execute(9, mem);
+    }
+    trace.Close(cpu.TotalCycles);
+    sound.CloseWav();
+    if (!HeatmapPrefix.empty()) {
+        heatmap.WriteCSV((HeatmapPrefix + ".csv").c_str());
+        heatmap.WritePPM((HeatmapPrefix + ".ppm").c_str());
+    }
 
     // Return 0 to indicate successful program execution.
     return 0;